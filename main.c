@@ -2,15 +2,23 @@
 #include <SDL2/SDL_ttf.h>
 #include <stdio.h>
 #include <math.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #define COLOR_BACKGROUND 0xFF808080
 #define COLOR_TEXT_PRIMARY 0xFFFFFFFF
 #define COLOR_TEXT_SECONDARY 0xFFA9A9A9
 #define COLOR_WIDGE 0xFFD2D2D2
+#define IDLE_TIMEOUT_MS 250
+#define CACHE_LINE_SIZE 64
 
 static int SCREEN_WIDTH = 640 * 1.75, SCREEN_HEIGHT = 360 * 1.75;
 static int imageOffsetX = 0, imageOffsetY = 0;
 static float imageZoom = 1.0f;
+static int frameRateCap = 0;
 static uint32_t EightBitPalette[256];
 
 static float alphaScale = 1.0f;
@@ -29,6 +37,7 @@ static float qScale = 1.0f;
 static float cScale = 1.0f;
 static float mScale = 1.0f;
 static float yCmyScale = 1.0f;
+static uint32_t parameterVersion = 1;
 
 typedef enum {
     FALSE,
@@ -36,6 +45,14 @@ typedef enum {
 } boolean;
 
 static boolean showHistogram = FALSE; 
+static boolean vsyncEnabled = FALSE;
+static boolean showProfiler = FALSE;
+static const char *traceFilePath = NULL;
+static const char *playbackPath = NULL;
+static const char *playbackSize = NULL;
+static const char *playbackFormatName = NULL;
+static double playbackRate = 25.0;
+static boolean playbackLoop = FALSE;
 
 typedef enum {
     BUTTON_IDLE,
@@ -55,14 +72,15 @@ typedef enum {
 typedef struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
-    SDL_Texture *texture;
+    SDL_Texture *cursor;
+    uint32_t cursorColor;
     Uint32 *pixels;
     boolean programSuccess;
 } API;
 
 typedef struct {
-    uint16_t x;
-    uint16_t y;
+    int x;
+    int y;
 } Point;
 
 typedef struct {
@@ -76,15 +94,6 @@ typedef struct {
     boolean checked;
 } Checkbox;
 
-static Checkbox checkboxes[7] = {
-    {{(uint16_t)(SCREEN_WIDTH - 50), 20}, TRUE},  // ARGB (default)
-    {{(uint16_t)(SCREEN_WIDTH - 50), 40}, FALSE}, // YUV
-    {{(uint16_t)(SCREEN_WIDTH - 50), 60}, FALSE}, // YIQ
-    {{(uint16_t)(SCREEN_WIDTH - 50), 80}, FALSE}, // CMY
-    {{(uint16_t)(SCREEN_WIDTH - 50), 100}, FALSE}, // Monochrome
-    {{(uint16_t)(SCREEN_WIDTH - 50), 120}, FALSE}, // Dithered
-    {{(uint16_t)(SCREEN_WIDTH - 50), 140}, FALSE}  // 8-bit mode
-};
 static DisplayMode currentDisplay = DISPLAY_ARGB;
 
 typedef struct
@@ -92,17 +101,74 @@ typedef struct
     Point position;
     char type;
 } Button;
-static Button buttons[26];
 
 void initializeAPI(API *);
 void disposeAPI(API *);
 void iterativeFunction(API *);
 void handleAPI(API *, Mouse);
+boolean frameNeeded(Mouse);
+void requestRedraw();
+void refreshAssets();
+int assetTimeout();
+void disposeAssets();
+void disposeDitherCache();
+void forgetMipmaps(const uint32_t *);
+void forgetTransforms(const uint32_t *);
+void CopyRow(const uint32_t *, uint32_t *, int);
+void disposeBlitter();
+void disposeGlyphAtlases();
+void disposeWorkerPool();
+int runBatch(int, char *[]);
+int runBench(int, char *[]);
+int runExport(int, char *[]);
+void *allocateAligned(size_t, size_t);
+void freeAligned(void *);
+void prepareColorTables();
+uint32_t averageFour(uint32_t, uint32_t, uint32_t, uint32_t);
+void disposeTileCache();
+boolean initializeLayers(SDL_Renderer *);
+void disposeLayers();
+void disposeUI();
+void disposeBufferPool();
+void disposeFrameArena();
+void writeTrace();
+boolean openPlayback();
+void closePlayback();
+void advancePlayback();
+int playbackTimeout();
 
 int main(int argc, char *args[]) {
+    if (argc > 1 && strcmp(args[1], "--batch") == 0)
+        return runBatch(argc - 2, args + 2);
+    if (argc > 1 && strcmp(args[1], "--bench") == 0)
+        return runBench(argc - 2, args + 2);
+    if (argc > 1 && strcmp(args[1], "--export") == 0)
+        return runExport(argc - 2, args + 2);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(args[i], "--vsync") == 0)
+            vsyncEnabled = TRUE;
+        else if (strcmp(args[i], "--fps") == 0 && i + 1 < argc)
+            frameRateCap = atoi(args[++i]);
+        else if (strcmp(args[i], "--profile") == 0 && i + 1 < argc)
+            traceFilePath = args[++i];
+        else if (strcmp(args[i], "--play") == 0 && i + 1 < argc)
+            playbackPath = args[++i];
+        else if (strcmp(args[i], "--size") == 0 && i + 1 < argc)
+            playbackSize = args[++i];
+        else if (strcmp(args[i], "--format") == 0 && i + 1 < argc)
+            playbackFormatName = args[++i];
+        else if (strcmp(args[i], "--rate") == 0 && i + 1 < argc)
+            playbackRate = atof(args[++i]);
+        else if (strcmp(args[i], "--loop") == 0)
+            playbackLoop = TRUE;
+    }
+    if (playbackRate <= 0.0)
+        playbackRate = 25.0;
     API _API;
     _API.programSuccess = TRUE;
     initializeAPI(&_API);
+    if (_API.programSuccess == TRUE && playbackPath && !openPlayback())
+        printf("Playback of %s is unavailable, showing the still image.\n", playbackPath);
     if (_API.programSuccess == TRUE) {
         iterativeFunction(&_API);
     }
@@ -145,40 +211,44 @@ void initializeAPI(API *_API){
     _API->renderer = SDL_CreateRenderer(
         _API->window,
         -1,
-        SDL_RENDERER_ACCELERATED
+        SDL_RENDERER_ACCELERATED | (vsyncEnabled ? SDL_RENDERER_PRESENTVSYNC : 0)
     );
     if (_API->renderer == NULL) {
         printf("SDL Renderer Initialization has failed, SDL Error: %s\n", SDL_GetError());
         _API->programSuccess = FALSE;
         return;
     }
-    _API->texture = SDL_CreateTexture(
+    _API->cursor = SDL_CreateTexture(
         _API->renderer,
         SDL_PIXELFORMAT_ARGB8888,
-        SDL_TEXTUREACCESS_STREAMING,
-        SCREEN_WIDTH,
-        SCREEN_HEIGHT
+        SDL_TEXTUREACCESS_STATIC,
+        6,
+        6
     );
-    if (_API->texture == NULL) {
+    if (_API->cursor == NULL || !initializeLayers(_API->renderer)) {
         printf("SDL Texture Initialization has failed, SDL Error: %s\n", SDL_GetError());
         _API->programSuccess = FALSE;
         return;
     }
-
-    _API->pixels = (Uint32 *)malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
-    if (_API->pixels == NULL) {
-        printf("Memory allocation for pixels failed.\n");
-        _API->programSuccess = FALSE;
-        return;
-    }
-    memset(_API->pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+    _API->cursorColor = 0;
+    _API->pixels = NULL;
 }
 
 void disposeAPI(API *_API) {
-    if (_API->pixels)
-        free(_API->pixels);
-    if (_API->texture)
-        SDL_DestroyTexture(_API->texture);
+    writeTrace();
+    closePlayback();
+    disposeWorkerPool();
+    disposeDitherCache();
+    disposeBlitter();
+    disposeGlyphAtlases();
+    disposeAssets();
+    disposeTileCache();
+    disposeBufferPool();
+    disposeFrameArena();
+    disposeLayers();
+    disposeUI();
+    if (_API->cursor)
+        SDL_DestroyTexture(_API->cursor);
     if (_API->renderer)
         SDL_DestroyRenderer(_API->renderer);
     if (_API->window)
@@ -186,6 +256,808 @@ void disposeAPI(API *_API) {
     SDL_Quit();
 }
 
+// PROFILER: high-resolution timings and allocation counts for each stage
+// of handleAPI. The last frame is shown by the overlay (toggled with P) and,
+// when --profile <file> is given, every stage is kept as a Chrome trace
+// event and written out when the program exits.
+#define PROFILE_HISTORY 60
+
+typedef enum {
+    STAGE_FRAME,
+    STAGE_ASSETS,
+    STAGE_IMAGE,
+    STAGE_PANEL,
+    STAGE_HISTOGRAM,
+    STAGE_UPLOAD,
+    STAGE_PRESENT,
+    STAGE_COUNT
+} ProfileStage;
+
+static const char *stageNames[STAGE_COUNT] = {"frame", "assets", "image", "panel", "histogram", "upload", "present"};
+
+typedef struct {
+    uint8_t stage;
+    Uint64 start;
+    Uint64 duration;
+    int allocations;
+} TraceEvent;
+
+typedef struct {
+    Uint64 origin;
+    Uint64 stageStart[STAGE_COUNT];
+    int stageAllocations[STAGE_COUNT];
+    Uint64 duration[STAGE_COUNT];
+    int allocations[STAGE_COUNT];
+    Uint64 shownDuration[STAGE_COUNT];
+    int shownAllocations[STAGE_COUNT];
+    Uint64 frameStarts[PROFILE_HISTORY];
+    int frameCount;
+    TraceEvent *events;
+    int eventCount;
+    int eventCapacity;
+} Profiler;
+
+static Profiler profiler;
+static SDL_atomic_t allocationCount;
+
+void *countedMalloc(size_t size) {
+    SDL_AtomicAdd(&allocationCount, 1);
+    return malloc(size);
+}
+
+void *countedCalloc(size_t count, size_t size) {
+    SDL_AtomicAdd(&allocationCount, 1);
+    return calloc(count, size);
+}
+
+void *countedRealloc(void *pointer, size_t size) {
+    SDL_AtomicAdd(&allocationCount, 1);
+    return realloc(pointer, size);
+}
+
+void beginStage(ProfileStage stage) {
+    if (profiler.origin == 0)
+        profiler.origin = SDL_GetPerformanceCounter();
+    profiler.stageStart[stage] = SDL_GetPerformanceCounter();
+    profiler.stageAllocations[stage] = SDL_AtomicGet(&allocationCount);
+    if (stage == STAGE_FRAME)
+        profiler.frameStarts[profiler.frameCount++ % PROFILE_HISTORY] = profiler.stageStart[stage];
+}
+
+void endStage(ProfileStage stage) {
+    Uint64 duration = SDL_GetPerformanceCounter() - profiler.stageStart[stage];
+    int allocations = SDL_AtomicGet(&allocationCount) - profiler.stageAllocations[stage];
+    profiler.duration[stage] = duration;
+    profiler.allocations[stage] = allocations;
+    if (stage == STAGE_FRAME) {
+        memcpy(profiler.shownDuration, profiler.duration, sizeof(profiler.duration));
+        memcpy(profiler.shownAllocations, profiler.allocations, sizeof(profiler.allocations));
+        memset(profiler.duration, 0, sizeof(profiler.duration));
+        memset(profiler.allocations, 0, sizeof(profiler.allocations));
+    }
+    if (traceFilePath == NULL)
+        return;
+    if (profiler.eventCount == profiler.eventCapacity) {
+        int capacity = profiler.eventCapacity ? profiler.eventCapacity * 2 : 1024;
+        TraceEvent *events = (TraceEvent *)realloc(profiler.events, capacity * sizeof(TraceEvent));
+        if (events == NULL)
+            return;
+        profiler.events = events;
+        profiler.eventCapacity = capacity;
+    }
+    profiler.events[profiler.eventCount++] = (TraceEvent){(uint8_t)stage, profiler.stageStart[stage] - profiler.origin, duration, allocations};
+}
+
+double stageMicroseconds(Uint64 ticks) {
+    return (double)ticks * 1000000.0 / SDL_GetPerformanceFrequency();
+}
+
+int framesPerSecond() {
+    int count = (profiler.frameCount < PROFILE_HISTORY) ? profiler.frameCount : PROFILE_HISTORY;
+    if (count < 2)
+        return 0;
+    Uint64 newest = profiler.frameStarts[(profiler.frameCount - 1) % PROFILE_HISTORY];
+    Uint64 oldest = profiler.frameStarts[(profiler.frameCount - count) % PROFILE_HISTORY];
+    if (newest == oldest)
+        return 0;
+    return (int)((count - 1) * (double)SDL_GetPerformanceFrequency() / (newest - oldest) + 0.5);
+}
+
+void writeTrace() {
+    if (traceFilePath == NULL)
+        return;
+    FILE *file = fopen(traceFilePath, "w");
+    if (file == NULL) {
+        printf("The trace file %s could not be written.\n", traceFilePath);
+    } else {
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (int i = 0; i < profiler.eventCount; i++) {
+            TraceEvent *event = &profiler.events[i];
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"allocations\":%d}}\n",
+                i ? "," : "", stageNames[event->stage], stageMicroseconds(event->start), stageMicroseconds(event->duration), event->allocations);
+        }
+        fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(file);
+    }
+    free(profiler.events);
+    profiler.events = NULL;
+    profiler.eventCount = profiler.eventCapacity = 0;
+}
+
+// FRAME MEMORY: scratch buffers that only live while a frame is drawn come
+// from a bump arena that is reset once the frame is presented, and
+// image-sized buffers that the caches drop and rebuild go back to a small
+// pool instead of the heap. The arena grows to the largest frame seen, so a
+// steady stream of frames makes no heap calls for scratch memory. Outside a
+// frame (batch, export, benchmarks) scratch memory comes from the heap.
+// Scratch memory has to be freed before the frame it was taken in ends.
+#define SCRATCH_ALIGNMENT 64
+#define FRAME_ARENA_LIMIT ((size_t)256 << 20)
+#define BUFFER_POOL_SLOTS 8
+#define BUFFER_POOL_BYTES ((size_t)128 << 20)
+
+typedef struct {
+    uint8_t *block;
+    size_t capacity;
+    boolean open;
+    SDL_atomic_t used;
+    SDL_atomic_t allocations;
+} FrameArena;
+
+typedef struct {
+    void *pointer;
+    size_t bytes;
+    Uint32 lastUsed;
+} PooledBuffer;
+
+typedef struct {
+    SDL_SpinLock lock;
+    PooledBuffer slots[BUFFER_POOL_SLOTS];
+    size_t heldBytes;
+    Uint32 clock;
+    SDL_atomic_t reusedKilobytes;
+    SDL_atomic_t reuses;
+} BufferPool;
+
+typedef struct {
+    int arenaKilobytes;
+    int arenaAllocations;
+    int poolKilobytes;
+    int poolReuses;
+} FrameMemory;
+
+static FrameArena frameArena;
+static BufferPool bufferPool;
+static FrameMemory frameMemory;
+
+void *scratchAlloc(size_t size) {
+    size = (size + SCRATCH_ALIGNMENT - 1) & ~(size_t)(SCRATCH_ALIGNMENT - 1);
+    if (frameArena.open && size <= FRAME_ARENA_LIMIT) {
+        SDL_AtomicAdd(&frameArena.allocations, 1);
+        size_t end = (size_t)SDL_AtomicAdd(&frameArena.used, (int)size) + size;
+        if (end <= frameArena.capacity)
+            return frameArena.block + end - size;
+    }
+    return countedMalloc(size);
+}
+
+void *scratchCalloc(size_t count, size_t size) {
+    void *pointer = scratchAlloc(count * size);
+    if (pointer)
+        memset(pointer, 0, count * size);
+    return pointer;
+}
+
+void scratchFree(void *pointer) {
+    uint8_t *bytes = (uint8_t *)pointer;
+    if (frameArena.block && bytes >= frameArena.block && bytes < frameArena.block + frameArena.capacity)
+        return;
+    free(pointer);
+}
+
+void openFrameArena() {
+    frameArena.open = TRUE;
+}
+
+// Called after the frame is presented. An arena that overflowed is
+// replaced by one large enough for the frame, with some headroom, up to
+// FRAME_ARENA_LIMIT.
+void closeFrameArena() {
+    size_t used = (size_t)SDL_AtomicGet(&frameArena.used);
+    frameMemory.arenaKilobytes = (int)(used >> 10);
+    frameMemory.arenaAllocations = SDL_AtomicGet(&frameArena.allocations);
+    frameMemory.poolKilobytes = SDL_AtomicGet(&bufferPool.reusedKilobytes);
+    frameMemory.poolReuses = SDL_AtomicGet(&bufferPool.reuses);
+    SDL_AtomicSet(&frameArena.used, 0);
+    SDL_AtomicSet(&frameArena.allocations, 0);
+    SDL_AtomicSet(&bufferPool.reusedKilobytes, 0);
+    SDL_AtomicSet(&bufferPool.reuses, 0);
+    frameArena.open = FALSE;
+    if (used <= frameArena.capacity || frameArena.capacity == FRAME_ARENA_LIMIT)
+        return;
+    freeAligned(frameArena.block);
+    size_t capacity = (used + used / 2 < FRAME_ARENA_LIMIT) ? used + used / 2 : FRAME_ARENA_LIMIT;
+    frameArena.block = (uint8_t *)allocateAligned(capacity, SCRATCH_ALIGNMENT);
+    frameArena.capacity = frameArena.block ? capacity : 0;
+}
+
+void disposeFrameArena() {
+    freeAligned(frameArena.block);
+    memset(&frameArena, 0, sizeof(frameArena));
+}
+
+// Hands out the smallest pooled buffer that holds the request without
+// wasting more than half of it. The buffer's real size is stored in
+// *capacity and is what the caller passes back to releaseBuffer.
+void *acquireBuffer(size_t bytes, size_t *capacity) {
+    void *pointer = NULL;
+    size_t pooledBytes = 0;
+    SDL_AtomicLock(&bufferPool.lock);
+    PooledBuffer *best = NULL;
+    for (int i = 0; i < BUFFER_POOL_SLOTS; i++) {
+        PooledBuffer *slot = &bufferPool.slots[i];
+        if (slot->pointer && slot->bytes >= bytes && slot->bytes / 2 <= bytes && (best == NULL || slot->bytes < best->bytes))
+            best = slot;
+    }
+    if (best) {
+        pointer = best->pointer;
+        pooledBytes = best->bytes;
+        bufferPool.heldBytes -= best->bytes;
+        best->pointer = NULL;
+    }
+    SDL_AtomicUnlock(&bufferPool.lock);
+    if (pointer == NULL) {
+        pointer = countedMalloc(bytes);
+        *capacity = pointer ? bytes : 0;
+        return pointer;
+    }
+    *capacity = pooledBytes;
+    SDL_AtomicAdd(&bufferPool.reuses, 1);
+    SDL_AtomicAdd(&bufferPool.reusedKilobytes, (int)(bytes >> 10));
+    return pointer;
+}
+
+// Keeps the buffer for reuse, evicting the least recently released ones
+// while the pool would hold more than BUFFER_POOL_BYTES.
+void releaseBuffer(void *pointer, size_t bytes) {
+    if (pointer == NULL)
+        return;
+    if (bytes > BUFFER_POOL_BYTES) {
+        free(pointer);
+        return;
+    }
+    void *evicted[BUFFER_POOL_SLOTS + 1];
+    int evictedCount = 0;
+    SDL_AtomicLock(&bufferPool.lock);
+    for (;;) {
+        PooledBuffer *oldest = NULL;
+        PooledBuffer *empty = NULL;
+        for (int i = 0; i < BUFFER_POOL_SLOTS; i++) {
+            PooledBuffer *slot = &bufferPool.slots[i];
+            if (slot->pointer == NULL)
+                empty = slot;
+            else if (oldest == NULL || slot->lastUsed < oldest->lastUsed)
+                oldest = slot;
+        }
+        if (empty && bufferPool.heldBytes + bytes <= BUFFER_POOL_BYTES) {
+            *empty = (PooledBuffer){pointer, bytes, ++bufferPool.clock};
+            bufferPool.heldBytes += bytes;
+            break;
+        }
+        if (oldest == NULL) {
+            evicted[evictedCount++] = pointer;
+            break;
+        }
+        evicted[evictedCount++] = oldest->pointer;
+        bufferPool.heldBytes -= oldest->bytes;
+        oldest->pointer = NULL;
+    }
+    SDL_AtomicUnlock(&bufferPool.lock);
+    for (int i = 0; i < evictedCount; i++)
+        free(evicted[i]);
+}
+
+void disposeBufferPool() {
+    for (int i = 0; i < BUFFER_POOL_SLOTS; i++)
+        free(bufferPool.slots[i].pointer);
+    memset(&bufferPool, 0, sizeof(bufferPool));
+}
+
+// WORKER POOL: persistent SDL threads that share one parallel job at a time.
+// The calling thread takes part in the job; a job started while another one
+// is running (for example from inside a task) runs on the caller alone.
+// Every participant owns a contiguous range of task indices and, once it is
+// empty, steals the back half of the fullest remaining range. Ordered jobs
+// instead hand out indices strictly in sequence from one shared counter,
+// which tasks that wait on their predecessor (the dither wavefront) rely on.
+#define MAX_WORKER_THREADS 64
+
+typedef void (*TaskFunction)(void *, int);
+
+typedef struct {
+    SDL_SpinLock lock;
+    int begin;
+    int end;
+    char padding[CACHE_LINE_SIZE - sizeof(SDL_SpinLock) - 2 * sizeof(int)];
+} TaskRange;
+
+typedef struct {
+    TaskFunction task;
+    void *context;
+    int taskCount;
+    boolean ordered;
+    SDL_atomic_t nextTask;
+    SDL_atomic_t nextRange;
+    int rangeCount;
+    TaskRange ranges[MAX_WORKER_THREADS + 1];
+    int activeWorkers;
+} ParallelJob;
+
+typedef struct {
+    SDL_Thread *threads[MAX_WORKER_THREADS];
+    int threadCount;
+    SDL_mutex *lock;
+    SDL_cond *workReady;
+    SDL_cond *workDone;
+    ParallelJob *currentJob;
+    unsigned generation;
+    SDL_atomic_t busy;
+    boolean quit;
+} WorkerPool;
+
+static WorkerPool workerPool;
+static int workerThreadLimit = 0;
+
+int popTask(TaskRange *range) {
+    int index = -1;
+    SDL_AtomicLock(&range->lock);
+    if (range->begin < range->end)
+        index = range->begin++;
+    SDL_AtomicUnlock(&range->lock);
+    return index;
+}
+
+int stealTasks(ParallelJob *job, TaskRange *own) {
+    for (;;) {
+        TaskRange *victim = NULL;
+        int remaining = 0;
+        for (int i = 0; i < job->rangeCount; i++) {
+            int count = job->ranges[i].end - job->ranges[i].begin;
+            if (&job->ranges[i] != own && count > remaining) {
+                victim = &job->ranges[i];
+                remaining = count;
+            }
+        }
+        if (victim == NULL)
+            return -1;
+        SDL_AtomicLock(&victim->lock);
+        int count = victim->end - victim->begin;
+        int stolenBegin = victim->end - (count + 1) / 2;
+        int stolenEnd = victim->end;
+        if (count > 0)
+            victim->end = stolenBegin;
+        SDL_AtomicUnlock(&victim->lock);
+        if (count <= 0)
+            continue;
+        SDL_AtomicLock(&own->lock);
+        own->begin = stolenBegin + 1;
+        own->end = stolenEnd;
+        SDL_AtomicUnlock(&own->lock);
+        return stolenBegin;
+    }
+}
+
+void runParallelTasks(ParallelJob *job) {
+    int index;
+    if (job->ordered) {
+        while ((index = SDL_AtomicAdd(&job->nextTask, 1)) < job->taskCount)
+            job->task(job->context, index);
+        return;
+    }
+    int slot = SDL_AtomicAdd(&job->nextRange, 1);
+    if (slot >= job->rangeCount)
+        return;
+    TaskRange *own = &job->ranges[slot];
+    while ((index = popTask(own)) >= 0 || (index = stealTasks(job, own)) >= 0)
+        job->task(job->context, index);
+}
+
+int workerThread(void *data) {
+    unsigned seenGeneration = 0;
+    SDL_LockMutex(workerPool.lock);
+    for (;;) {
+        while (!workerPool.quit && (workerPool.currentJob == NULL || workerPool.generation == seenGeneration))
+            SDL_CondWait(workerPool.workReady, workerPool.lock);
+        if (workerPool.quit)
+            break;
+        seenGeneration = workerPool.generation;
+        ParallelJob *job = workerPool.currentJob;
+        job->activeWorkers++;
+        SDL_UnlockMutex(workerPool.lock);
+        runParallelTasks(job);
+        SDL_LockMutex(workerPool.lock);
+        if (--job->activeWorkers == 0)
+            SDL_CondBroadcast(workerPool.workDone);
+    }
+    SDL_UnlockMutex(workerPool.lock);
+    return 0;
+}
+
+int workerCount() {
+    return workerPool.threadCount + 1;
+}
+
+void initializeWorkerPool() {
+    if (workerPool.lock)
+        return;
+    int threadCount = (workerThreadLimit > 0) ? workerThreadLimit : SDL_GetCPUCount();
+    threadCount -= 1;
+    if (threadCount > MAX_WORKER_THREADS)
+        threadCount = MAX_WORKER_THREADS;
+    workerPool.lock = SDL_CreateMutex();
+    workerPool.workReady = SDL_CreateCond();
+    workerPool.workDone = SDL_CreateCond();
+    for (int i = 0; i < threadCount; i++) {
+        SDL_Thread *thread = SDL_CreateThread(workerThread, "worker", NULL);
+        if (thread == NULL) {
+            printf("Worker thread creation failed, SDL Error: %s\n", SDL_GetError());
+            break;
+        }
+        workerPool.threads[workerPool.threadCount++] = thread;
+    }
+}
+
+void disposeWorkerPool() {
+    if (workerPool.lock == NULL)
+        return;
+    SDL_LockMutex(workerPool.lock);
+    workerPool.quit = TRUE;
+    SDL_CondBroadcast(workerPool.workReady);
+    SDL_UnlockMutex(workerPool.lock);
+    for (int i = 0; i < workerPool.threadCount; i++)
+        SDL_WaitThread(workerPool.threads[i], NULL);
+    SDL_DestroyCond(workerPool.workDone);
+    SDL_DestroyCond(workerPool.workReady);
+    SDL_DestroyMutex(workerPool.lock);
+    memset(&workerPool, 0, sizeof(workerPool));
+}
+
+void splitTaskRanges(ParallelJob *job, int rangeCount) {
+    job->rangeCount = rangeCount;
+    for (int i = 0; i < rangeCount; i++) {
+        job->ranges[i].lock = 0;
+        job->ranges[i].begin = (int)((int64_t)job->taskCount * i / rangeCount);
+        job->ranges[i].end = (int)((int64_t)job->taskCount * (i + 1) / rangeCount);
+    }
+}
+
+void startParallelJob(TaskFunction task, void *context, int taskCount, boolean ordered) {
+    ParallelJob job;
+    job.task = task;
+    job.context = context;
+    job.taskCount = taskCount;
+    job.ordered = ordered;
+    job.activeWorkers = 0;
+    SDL_AtomicSet(&job.nextTask, 0);
+    SDL_AtomicSet(&job.nextRange, 0);
+    if (taskCount > 1)
+        initializeWorkerPool();
+    if (taskCount <= 1 || workerPool.threadCount == 0 || !SDL_AtomicCAS(&workerPool.busy, 0, 1)) {
+        splitTaskRanges(&job, 1);
+        runParallelTasks(&job);
+        return;
+    }
+    splitTaskRanges(&job, workerCount());
+    SDL_LockMutex(workerPool.lock);
+    workerPool.currentJob = &job;
+    workerPool.generation++;
+    SDL_CondBroadcast(workerPool.workReady);
+    SDL_UnlockMutex(workerPool.lock);
+    runParallelTasks(&job);
+    SDL_LockMutex(workerPool.lock);
+    while (job.activeWorkers > 0)
+        SDL_CondWait(workerPool.workDone, workerPool.lock);
+    workerPool.currentJob = NULL;
+    SDL_UnlockMutex(workerPool.lock);
+    SDL_AtomicSet(&workerPool.busy, 0);
+}
+
+void runParallel(TaskFunction task, void *context, int taskCount) {
+    startParallelJob(task, context, taskCount, FALSE);
+}
+
+void runParallelOrdered(TaskFunction task, void *context, int taskCount) {
+    startParallelJob(task, context, taskCount, TRUE);
+}
+
+// FRAME BANDS: per-frame pixel work is split into horizontal bands of rows
+// and spread over the worker pool. Band boundaries fall on cache lines of
+// the frame buffer so no two threads write the same line, and runBands
+// returns only after every band is done, which is the barrier before the
+// texture upload.
+typedef void (*BandFunction)(void *, int, int);
+
+typedef struct {
+    BandFunction function;
+    void *context;
+    int firstRow;
+    int lastRow;
+    int bandRows;
+    int firstBand;
+} BandJob;
+
+typedef struct {
+    uint32_t *pixels;
+    SDL_Rect rect;
+    uint32_t color;
+} FillJob;
+
+void *allocateAligned(size_t size, size_t alignment) {
+    uint8_t *block = (uint8_t *)countedMalloc(size + alignment + sizeof(void *));
+    if (block == NULL)
+        return NULL;
+    uintptr_t aligned = ((uintptr_t)(block + sizeof(void *)) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    ((void **)aligned)[-1] = block;
+    return (void *)aligned;
+}
+
+void freeAligned(void *pointer) {
+    if (pointer)
+        free(((void **)pointer)[-1]);
+}
+
+void runBand(void *context, int index) {
+    BandJob *job = (BandJob *)context;
+    int first = (job->firstBand + index) * job->bandRows;
+    int last = first + job->bandRows;
+    job->function(job->context, (first > job->firstRow) ? first : job->firstRow, (last < job->lastRow) ? last : job->lastRow);
+}
+
+void runBands(BandFunction function, void *context, int firstRow, int lastRow) {
+    if (firstRow >= lastRow)
+        return;
+    int granularity = 1;
+    while ((granularity * SCREEN_WIDTH * (int)sizeof(uint32_t)) % CACHE_LINE_SIZE != 0)
+        granularity *= 2;
+    int bandRows = (lastRow - firstRow) / (workerCount() * 4);
+    if (bandRows < 8)
+        bandRows = 8;
+    bandRows = (bandRows + granularity - 1) / granularity * granularity;
+    BandJob job = {function, context, firstRow, lastRow, bandRows, firstRow / bandRows};
+    runParallel(runBand, &job, (lastRow - 1) / bandRows - job.firstBand + 1);
+}
+
+void fillBand(void *context, int firstRow, int lastRow) {
+    FillJob *job = (FillJob *)context;
+    for (int y = firstRow; y < lastRow; y++) {
+        uint32_t *row = job->pixels + y * SCREEN_WIDTH + job->rect.x;
+        for (int x = 0; x < job->rect.w; x++)
+            row[x] = job->color;
+    }
+}
+
+void fillRect(uint32_t *pixels, SDL_Rect rect, uint32_t color) {
+    FillJob job = {pixels, rect, color};
+    runBands(fillBand, &job, rect.y, rect.y + rect.h);
+}
+
+// UI LAYOUT: the control panel is a retained list of widgets laid out once
+// for the current screen size. Clicks are resolved through a uniform grid of
+// cells that lists the widgets whose hit box overlaps each cell, and every
+// widget carries a damage flag, so a change repaints and uploads only the
+// widgets it touched. The panel background is the first widget; damaging it
+// stands for repainting the whole panel.
+#define UI_GRID_CELL 32
+#define UI_MARGIN 8
+#define UI_BUTTON_SIZE 16
+#define UI_TEXT_OFFSET_Y 5
+#define UI_MODE_COUNT 7
+
+typedef enum {
+    WIDGET_PANEL,
+    WIDGET_TITLE,
+    WIDGET_MODE,
+    WIDGET_BUTTON,
+    WIDGET_LABEL
+} WidgetType;
+
+typedef struct {
+    WidgetType type;
+    SDL_Rect bounds;
+    SDL_Rect hit;
+    Point position;
+    const char *text;
+    int value;
+    char symbol;
+    boolean damaged;
+} Widget;
+
+typedef struct {
+    int screenWidth;
+    int screenHeight;
+    Widget *widgets;
+    int widgetCount;
+    int widgetCapacity;
+    int modeWidgets[UI_MODE_COUNT];
+    DisplayMode shownDisplay;
+    int damagedCount;
+    int gridColumns;
+    int gridRows;
+    int *cellStart;
+    int *cellWidgets;
+} UILayout;
+
+static UILayout ui;
+
+static const char *modeLabels[UI_MODE_COUNT] = {
+    "argb mode", "yuv mode", "yiq mode", "cmy mode", "monochrome mode", "dithered mode", "eight bit mode"};
+static const char *componentLabels[UI_MODE_COUNT][4] = {
+    {"alpha component", "red component", "green component", "blue component"},
+    {"y component", "u component", "v component"},
+    {"y component", "i component", "q component"},
+    {"c component", "m component", "y component"},
+    {""},
+    {""},
+    {""}
+};
+static const int componentCounts[UI_MODE_COUNT] = {4, 3, 3, 3, 0, 0, 0};
+
+void damageWidget(int index) {
+    if (index < 0 || index >= ui.widgetCount || ui.widgets[index].damaged)
+        return;
+    ui.widgets[index].damaged = TRUE;
+    ui.damagedCount++;
+}
+
+boolean panelDamaged() {
+    return (ui.damagedCount > 0) ? TRUE : FALSE;
+}
+
+void damagePanel() {
+    damageWidget(0);
+}
+
+// The painted bounds include the drop shadow drawn two pixels below and to
+// the right of checkboxes and buttons, clipped to the panel.
+int addWidget(WidgetType type, SDL_Rect bounds, SDL_Rect hit, Point position, const char *text, int value, char symbol) {
+    if (ui.widgetCount == ui.widgetCapacity) {
+        ui.widgetCapacity = ui.widgetCapacity ? ui.widgetCapacity * 2 : 64;
+        ui.widgets = (Widget *)countedRealloc(ui.widgets, ui.widgetCapacity * sizeof(Widget));
+    }
+    SDL_Rect panel = {SCREEN_WIDTH / 2, 0, SCREEN_WIDTH - SCREEN_WIDTH / 2, SCREEN_HEIGHT};
+    Widget *widget = &ui.widgets[ui.widgetCount];
+    widget->type = type;
+    if (!SDL_IntersectRect(&bounds, &panel, &widget->bounds))
+        widget->bounds = (SDL_Rect){0, 0, 0, 0};
+    widget->hit = hit;
+    widget->position = position;
+    widget->text = text;
+    widget->value = value;
+    widget->symbol = symbol;
+    widget->damaged = TRUE;
+    ui.damagedCount++;
+    return ui.widgetCount++;
+}
+
+void buildWidgetGrid() {
+    free(ui.cellStart);
+    free(ui.cellWidgets);
+    ui.gridColumns = (ui.screenWidth + UI_GRID_CELL - 1) / UI_GRID_CELL;
+    ui.gridRows = (ui.screenHeight + UI_GRID_CELL - 1) / UI_GRID_CELL;
+    int cells = ui.gridColumns * ui.gridRows;
+    ui.cellStart = (int *)countedCalloc(cells + 1, sizeof(int));
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            for (int cell = 0; cell < cells; cell++)
+                ui.cellStart[cell + 1] += ui.cellStart[cell];
+            ui.cellWidgets = (int *)countedMalloc((ui.cellStart[cells] + 1) * sizeof(int));
+        }
+        for (int i = 0; i < ui.widgetCount; i++) {
+            SDL_Rect hit = ui.widgets[i].hit;
+            if (SDL_RectEmpty(&hit))
+                continue;
+            int firstColumn = hit.x / UI_GRID_CELL;
+            int lastColumn = (hit.x + hit.w - 1) / UI_GRID_CELL;
+            int firstRow = hit.y / UI_GRID_CELL;
+            int lastRow = (hit.y + hit.h - 1) / UI_GRID_CELL;
+            for (int row = firstRow; row <= lastRow && row < ui.gridRows; row++) {
+                for (int column = firstColumn; column <= lastColumn && column < ui.gridColumns; column++) {
+                    int cell = row * ui.gridColumns + column;
+                    if (pass == 0)
+                        ui.cellStart[cell + 1]++;
+                    else
+                        ui.cellWidgets[ui.cellStart[cell]++] = i;
+                }
+            }
+        }
+    }
+    for (int cell = cells; cell > 0; cell--)
+        ui.cellStart[cell] = ui.cellStart[cell - 1];
+    ui.cellStart[0] = 0;
+}
+
+// Positions follow the original immediate-mode panel: a title, then one
+// highlighted row per display mode with a row of -/+ buttons and a label
+// for each of its components, stopping at the bottom of the screen.
+const UILayout *uiLayout() {
+    if (ui.widgets && ui.screenWidth == SCREEN_WIDTH && ui.screenHeight == SCREEN_HEIGHT)
+        return &ui;
+    ui.screenWidth = SCREEN_WIDTH;
+    ui.screenHeight = SCREEN_HEIGHT;
+    ui.widgetCount = 0;
+    ui.damagedCount = 0;
+    for (int i = 0; i < UI_MODE_COUNT; i++)
+        ui.modeWidgets[i] = -1;
+    SDL_Rect empty = {0, 0, 0, 0};
+    int startX = SCREEN_WIDTH / 2 + UI_MARGIN;
+    int cursorY = UI_MARGIN;
+    int rowWidth = SCREEN_WIDTH - UI_MARGIN - startX;
+    addWidget(WIDGET_PANEL, (SDL_Rect){SCREEN_WIDTH / 2, 0, SCREEN_WIDTH - SCREEN_WIDTH / 2, SCREEN_HEIGHT}, empty, (Point){0, 0}, NULL, 0, 0);
+    Point titlePosition = {startX + 20, cursorY + UI_TEXT_OFFSET_Y};
+    addWidget(WIDGET_TITLE, (SDL_Rect){titlePosition.x, titlePosition.y, SCREEN_WIDTH - UI_MARGIN - titlePosition.x, 16}, empty, titlePosition, "image display modes", 0, 0);
+    cursorY += 24;
+    int buttonIndex = 0;
+    for (int i = 0; i < UI_MODE_COUNT; i++) {
+        cursorY += UI_MARGIN;
+        if (cursorY + 20 >= SCREEN_HEIGHT) break;
+        Point checkbox = {startX + UI_MARGIN, cursorY + 3};
+        ui.modeWidgets[i] = addWidget(WIDGET_MODE, (SDL_Rect){startX, cursorY, rowWidth, 21},
+                                      (SDL_Rect){checkbox.x, checkbox.y, UI_BUTTON_SIZE, UI_BUTTON_SIZE}, checkbox, modeLabels[i], i, 0);
+        cursorY += 20;
+        if (cursorY >= SCREEN_HEIGHT) break;
+        for (int j = 0; j < componentCounts[i]; j++) {
+            if (cursorY + 18 >= SCREEN_HEIGHT) break;
+            int minusButtonX = startX + UI_MARGIN;
+            int plusButtonX = minusButtonX + UI_BUTTON_SIZE + UI_MARGIN;
+            int textX = plusButtonX + UI_BUTTON_SIZE + UI_MARGIN;
+            SDL_Rect minus = {minusButtonX, cursorY + 3, UI_BUTTON_SIZE, UI_BUTTON_SIZE};
+            SDL_Rect plus = {plusButtonX, cursorY + 3, UI_BUTTON_SIZE, UI_BUTTON_SIZE};
+            addWidget(WIDGET_BUTTON, (SDL_Rect){minus.x, minus.y, UI_BUTTON_SIZE + 2, UI_BUTTON_SIZE + 2}, minus, (Point){minus.x, minus.y}, NULL, buttonIndex++, '-');
+            addWidget(WIDGET_BUTTON, (SDL_Rect){plus.x, plus.y, UI_BUTTON_SIZE + 2, UI_BUTTON_SIZE + 2}, plus, (Point){plus.x, plus.y}, NULL, buttonIndex++, '+');
+            Point textPosition = {textX, cursorY + UI_TEXT_OFFSET_Y};
+            addWidget(WIDGET_LABEL, (SDL_Rect){textX, textPosition.y, SCREEN_WIDTH - UI_MARGIN - textX, 16}, empty, textPosition, componentLabels[i][j], 0, 0);
+            cursorY += 18;
+            if (cursorY >= SCREEN_HEIGHT) break;
+        }
+        cursorY += UI_MARGIN;
+    }
+    ui.shownDisplay = currentDisplay;
+    buildWidgetGrid();
+    return &ui;
+}
+
+const Widget *widgetAt(Point point) {
+    const UILayout *layout = uiLayout();
+    if (point.x < 0 || point.y < 0 || point.x >= layout->screenWidth || point.y >= layout->screenHeight)
+        return NULL;
+    int cell = (point.y / UI_GRID_CELL) * layout->gridColumns + point.x / UI_GRID_CELL;
+    for (int i = layout->cellStart[cell]; i < layout->cellStart[cell + 1]; i++) {
+        const Widget *widget = &layout->widgets[layout->cellWidgets[i]];
+        SDL_Point inside = {point.x, point.y};
+        if (SDL_PointInRect(&inside, &widget->hit))
+            return widget;
+    }
+    return NULL;
+}
+
+// The display mode can change outside a click, so the highlighted rows are
+// compared with the mode they were last painted for.
+void damageChangedWidgets() {
+    const UILayout *layout = uiLayout();
+    if (layout->shownDisplay == currentDisplay)
+        return;
+    damageWidget(layout->modeWidgets[layout->shownDisplay]);
+    damageWidget(layout->modeWidgets[currentDisplay]);
+    ui.shownDisplay = currentDisplay;
+}
+
+void disposeUI() {
+    free(ui.widgets);
+    free(ui.cellStart);
+    free(ui.cellWidgets);
+    memset(&ui, 0, sizeof(ui));
+}
+
 void adjustParameter(int index) {
     float step = 0.1f;
     int mode = -1;
@@ -227,38 +1099,22 @@ void adjustParameter(int index) {
         } else {
             *target -= step;
         }
+        parameterVersion++;
     }
 }
 
-void updateMouseState(Mouse *_Mouse, SDL_Event *event, Checkbox *checkboxes, DisplayMode *displayMode) {
+void updateMouseState(Mouse *_Mouse, SDL_Event *event, DisplayMode *displayMode) {
     if (event->type == SDL_MOUSEMOTION) {
-        _Mouse->mouseLocation.x = (uint16_t)event->motion.x;
-        _Mouse->mouseLocation.y = (uint16_t)event->motion.y;
+        _Mouse->mouseLocation.x = event->motion.x;
+        _Mouse->mouseLocation.y = event->motion.y;
     } else if (event->type == SDL_MOUSEBUTTONDOWN) {
         if (event->button.button == SDL_BUTTON_LEFT) {
             _Mouse->_MouseButtonLeft = BUTTON_PRESSED;
-            for (int i = 0; i < 7; i++) {
-                if (_Mouse->mouseLocation.x >= checkboxes[i].position.x &&
-                    _Mouse->mouseLocation.x < checkboxes[i].position.x + 16 &&
-                    _Mouse->mouseLocation.y >= checkboxes[i].position.y &&
-                    _Mouse->mouseLocation.y < checkboxes[i].position.y + 16)
-                {
-                    for (int j = 0; j < 7; j++) {
-                        checkboxes[j].checked = FALSE;
-                    }
-                    checkboxes[i].checked = TRUE;
-                    *displayMode = (DisplayMode)i;
-                }
-            }
-            for (int i = 0; i < 26; i++) {
-                if (_Mouse->mouseLocation.x >= buttons[i].position.x &&
-                    _Mouse->mouseLocation.x < buttons[i].position.x + 16 &&
-                    _Mouse->mouseLocation.y >= buttons[i].position.y &&
-                    _Mouse->mouseLocation.y < buttons[i].position.y + 16)
-                {
-                    adjustParameter(i);  
-                }
-            }
+            const Widget *widget = widgetAt(_Mouse->mouseLocation);
+            if (widget && widget->type == WIDGET_MODE)
+                *displayMode = (DisplayMode)widget->value;
+            else if (widget && widget->type == WIDGET_BUTTON)
+                adjustParameter(widget->value);
         }
     }
     else if (event->type == SDL_MOUSEBUTTONUP) {
@@ -297,6 +1153,9 @@ void imageMovement(SDL_Event *event) {
             else
                 showHistogram = TRUE;
             break;
+        case SDLK_p:
+            showProfiler = showProfiler ? FALSE : TRUE;
+            break;
         }
     }
 }
@@ -305,454 +1164,3015 @@ void iterativeFunction(API *_API) {
     SDL_Event event;
     boolean quitRequest = FALSE;
     Mouse _Mouse = {{0, 0}, BUTTON_IDLE, BUTTON_IDLE};
+    Uint32 frameInterval = (frameRateCap > 0) ? 1000 / frameRateCap : 0;
+    Uint32 nextFrameTime = SDL_GetTicks();
 
     while (!quitRequest) {
-        handleAPI(_API, _Mouse);
-        while (SDL_PollEvent(&event) != 0) {
+        refreshAssets();
+        advancePlayback();
+        int timeout = (playbackTimeout() < assetTimeout()) ? playbackTimeout() : assetTimeout();
+        if (frameNeeded(_Mouse)) {
+            Uint32 now = SDL_GetTicks();
+            if (SDL_TICKS_PASSED(now, nextFrameTime)) {
+                handleAPI(_API, _Mouse);
+                nextFrameTime = now + frameInterval;
+            } else if ((int)(nextFrameTime - now) < timeout) {
+                timeout = (int)(nextFrameTime - now);
+            }
+        }
+        if (SDL_WaitEventTimeout(&event, timeout) == 0)
+            continue;
+        do {
             if (event.type == SDL_QUIT) {
                 quitRequest = TRUE;
             } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE) {
                 quitRequest = TRUE;
+            } else if (event.type == SDL_WINDOWEVENT) {
+                requestRedraw();
             } else {
-                updateMouseState(&_Mouse, &event, checkboxes, &currentDisplay);
+                updateMouseState(&_Mouse, &event, &currentDisplay);
                 imageMovement(&event);
             }
-        }
+        } while (SDL_PollEvent(&event) != 0);
     }
 }
 
+// The cursor is its own 6x6 texture copied on top of the composited frame,
+// so moving it only changes the destination rectangle.
 void drawMouse(API *_API, Mouse _Mouse) {
     uint32_t mouseColor = (_Mouse._MouseButtonLeft == BUTTON_PRESSED) ? 0xFFFF0000 : 0xFFFFFFFF;
-    for (uint16_t y = _Mouse.mouseLocation.y - 3; y < _Mouse.mouseLocation.y + 3; y++) {
-        if (y < 0 || y >= SCREEN_HEIGHT)
-            continue;
-        for (uint16_t x = _Mouse.mouseLocation.x - 3; x < _Mouse.mouseLocation.x + 3; x++) {
-            if (x < 0 || x >= SCREEN_WIDTH)
-                continue;
-            _API->pixels[y * SCREEN_WIDTH + x] = mouseColor;
-        }
+    if (mouseColor != _API->cursorColor) {
+        uint32_t cursorPixels[36];
+        for (int i = 0; i < 36; i++)
+            cursorPixels[i] = mouseColor;
+        SDL_UpdateTexture(_API->cursor, NULL, cursorPixels, 6 * sizeof(uint32_t));
+        _API->cursorColor = mouseColor;
     }
+    SDL_Rect area = {_Mouse.mouseLocation.x - 3, _Mouse.mouseLocation.y - 3, 6, 6};
+    SDL_RenderCopy(_API->renderer, _API->cursor, NULL, &area);
 }
 
+typedef struct TiledImage TiledImage;
+
+// Images too large to decode into memory leave pixelArray NULL and are read
+// through a tiled store instead (see TILED IMAGES).
 typedef struct {
     int width;
     int height;
     uint32_t *pixelArray;
+    TiledImage *tiles;
 } image;
 
-image loadImage(const char *filePath) {
-    SDL_Surface *imageSurface = SDL_LoadBMP(filePath);
-    if (imageSurface == NULL) {
-        printf("The image failed to load, SDL_ERROR: %s\n", SDL_GetError());
-        return (image){0, 0, NULL};
-    }
-    uint16_t width = imageSurface->w;
-    uint16_t height = imageSurface->h;
+boolean saveImage(const char *, image);
 
-    uint32_t *pixelArray = (uint32_t *)malloc(width * height * sizeof(uint32_t));
-    if (pixelArray == NULL) {
-        printf("Memory allocation failed for the loaded image!\n");
-        SDL_FreeSurface(imageSurface);
-        return (image){0, 0, NULL};
-    }
+// BMP DECODER: the common uncompressed layouts are converted a whole row at a
+// time straight from the file bytes; anything else goes through SDL_LoadBMP.
+typedef struct {
+    int width;
+    int height;
+    boolean topDown;
+    int bitsPerPixel;
+    uint32_t compression;
+    boolean hasAlpha;
+    uint8_t shuffle[16];
+    uint32_t palette[256];
+    size_t pixelOffset;
+    size_t rowStride;
+} BMPInfo;
 
-    Uint32 *pixelBuffer = (Uint32 *)imageSurface->pixels;
-    for (uint16_t y = 0; y < height; y++) {
-        for (uint16_t x = 0; x < width; x++)
-        {
-            Uint32 pixel = pixelBuffer[y * width + x];
-            Uint8 r, g, b, a;
-            SDL_GetRGBA(pixel, imageSurface->format, &r, &g, &b, &a);
-            pixelArray[y * width + x] = (a << 24) | (r << 16) | (g << 8) | b;
-        }
+typedef void (*RowDecoder)(const uint8_t *, uint32_t *, int, const BMPInfo *);
+
+// Filled in by a load running on another thread: reading the file is the
+// first half of permille and decoding the second. Setting cancelled makes
+// the load give up at the next chunk or band of rows.
+#define LOAD_READ_CHUNK (8 << 20)
+#define LOAD_PROGRESS_ROWS 64
+
+typedef struct {
+    SDL_atomic_t permille;
+    SDL_atomic_t cancelled;
+} LoadProgress;
+
+static inline boolean loadCancelled(LoadProgress *progress) {
+    return (progress && SDL_AtomicGet(&progress->cancelled)) ? TRUE : FALSE;
+}
+
+static inline void reportProgress(LoadProgress *progress, int first, uint64_t done, uint64_t total) {
+    if (progress)
+        SDL_AtomicSet(&progress->permille, first + (int)(total ? done * 500 / total : 500));
+}
+
+static uint32_t readLE32(const uint8_t *bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint16_t readLE16(const uint8_t *bytes) {
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static int maskByte(uint32_t mask) {
+    for (int i = 0; i < 4; i++) {
+        if (mask == (0xFFu << (i * 8)))
+            return i;
     }
-    SDL_FreeSurface(imageSurface);
-    return (image){width, height, pixelArray};
+    return -1;
 }
 
-void applyImageMovement(uint32_t *pixels, image _image, Point point, uint32_t (*colorFunction)(uint32_t)) {
-    int scaledWidth = (int)(_image.width * imageZoom);
-    int scaledHeight = (int)(_image.height * imageZoom);
+boolean parseBMPHeader(const uint8_t *data, size_t size, BMPInfo *info) {
+    if (size < 54 || data[0] != 'B' || data[1] != 'M')
+        return FALSE;
+    uint32_t headerSize = readLE32(data + 14);
+    if (headerSize < 40 || 14 + (size_t)headerSize > size)
+        return FALSE;
+    int32_t width = (int32_t)readLE32(data + 18);
+    int32_t height = (int32_t)readLE32(data + 22);
+    info->bitsPerPixel = readLE16(data + 28);
+    info->compression = readLE32(data + 30);
+    if (width <= 0 || height == 0 || height == INT32_MIN)
+        return FALSE;
+    info->width = width;
+    info->topDown = (height < 0) ? TRUE : FALSE;
+    info->height = (height < 0) ? -height : height;
+    info->pixelOffset = readLE32(data + 10);
+    info->rowStride = (((size_t)info->width * info->bitsPerPixel + 31) / 32) * 4;
+    if (info->pixelOffset + info->rowStride * info->height > size)
+        return FALSE;
 
-    for (int screenY = 0; screenY < scaledHeight; screenY++) {
-        int finalY = point.y + screenY + imageOffsetY;
-        if (finalY < 0)
-            continue;
-        if (finalY >= SCREEN_HEIGHT)
-            break;
-        for (int screenX = 0; screenX < scaledWidth; screenX++) {
-            int finalX = point.x + screenX + imageOffsetX;
-            if (finalX < 0)
-                continue;
-            if (finalX >= SCREEN_WIDTH / 2)
-                continue;
-            int srcX = (int)((screenX) / imageZoom);
-            int srcY = (int)((screenY) / imageZoom);
-            if (srcX >= 0 && srcX < _image.width && srcY >= 0 && srcY < _image.height) {
-                uint32_t pixel = _image.pixelArray[srcY * _image.width + srcX];
-                if (finalY * SCREEN_WIDTH + finalX < SCREEN_WIDTH * SCREEN_HEIGHT) {
-                    pixels[finalY * SCREEN_WIDTH + finalX] = colorFunction(pixel);
-                }
+    uint32_t masks[4] = {0x00FF0000, 0x0000FF00, 0x000000FF, 0};
+    size_t paletteOffset = 14 + headerSize;
+    if (info->compression == 3 || info->compression == 6) {
+        if (size < 70)
+            return FALSE;
+        masks[0] = readLE32(data + 54);
+        masks[1] = readLE32(data + 58);
+        masks[2] = readLE32(data + 62);
+        if (headerSize >= 56 || info->compression == 6)
+            masks[3] = readLE32(data + 66);
+        if (headerSize == 40)
+            paletteOffset += (info->compression == 6) ? 16 : 12;
+    } else if (info->compression != 0) {
+        return FALSE;
+    }
+
+    if (info->bitsPerPixel == 32) {
+        // Output byte order of a little-endian ARGB word is B, G, R, A.
+        int sourceByte[4] = {maskByte(masks[2]), maskByte(masks[1]), maskByte(masks[0]), maskByte(masks[3])};
+        if (sourceByte[0] < 0 || sourceByte[1] < 0 || sourceByte[2] < 0 || (masks[3] != 0 && sourceByte[3] < 0))
+            return FALSE;
+        info->hasAlpha = (masks[3] != 0) ? TRUE : FALSE;
+        for (int pixel = 0; pixel < 4; pixel++) {
+            for (int channel = 0; channel < 4; channel++) {
+                int source = sourceByte[channel];
+                info->shuffle[pixel * 4 + channel] = (source < 0) ? 0x80 : (uint8_t)(pixel * 4 + source);
             }
         }
+        // BI_RGB files without an alpha mask still carry a fourth byte, which
+        // is used when it holds any data (the same rule SDL_LoadBMP applies).
+        if (info->compression == 0) {
+            for (int pixel = 0; pixel < 4; pixel++)
+                info->shuffle[pixel * 4 + 3] = (uint8_t)(pixel * 4 + 3);
+        }
+    } else if (info->bitsPerPixel == 24) {
+        if (info->compression != 0)
+            return FALSE;
+        info->hasAlpha = FALSE;
+        for (int pixel = 0; pixel < 4; pixel++) {
+            info->shuffle[pixel * 4 + 0] = (uint8_t)(pixel * 3 + 0);
+            info->shuffle[pixel * 4 + 1] = (uint8_t)(pixel * 3 + 1);
+            info->shuffle[pixel * 4 + 2] = (uint8_t)(pixel * 3 + 2);
+            info->shuffle[pixel * 4 + 3] = 0x80;
+        }
+    } else if (info->bitsPerPixel == 8) {
+        if (info->compression != 0)
+            return FALSE;
+        uint32_t colorsUsed = readLE32(data + 46);
+        if (colorsUsed == 0 || colorsUsed > 256)
+            colorsUsed = 256;
+        if (paletteOffset + colorsUsed * 4 > size)
+            return FALSE;
+        info->hasAlpha = FALSE;
+        memset(info->palette, 0, sizeof(info->palette));
+        for (uint32_t i = 0; i < colorsUsed; i++)
+            info->palette[i] = 0xFF000000 | (readLE32(data + paletteOffset + i * 4) & 0x00FFFFFF);
+    } else {
+        return FALSE;
     }
+    return TRUE;
 }
 
-uint32_t ARGBColor(uint32_t pixel) {
-    uint8_t a = (pixel >> 24) & 0xFF;
-    uint8_t r = (pixel >> 16) & 0xFF;
-    uint8_t g = (pixel >> 8) & 0xFF;
-    uint8_t b = pixel & 0xFF;
-    a = (uint8_t)(a * alphaScale);
-    r = (uint8_t)(r * redScale);
-    g = (uint8_t)(g * greenScale);
-    b = (uint8_t)(b * blueScale);
-    return (a << 24) | (r << 16) | (g << 8) | b;
+void decodeRow8(const uint8_t *source, uint32_t *destination, int count, const BMPInfo *info) {
+    for (int x = 0; x < count; x++)
+        destination[x] = info->palette[source[x]];
 }
 
-uint32_t YUVColor(uint32_t pixel) {
-    uint8_t a = (pixel >> 24) & 0xFF;
-    uint8_t r = (pixel >> 16) & 0xFF;
-    uint8_t g = (pixel >> 8) & 0xFF;
-    uint8_t b = pixel & 0xFF;
-    uint8_t Y = (uint8_t)((0.299 * r + 0.587 * g + 0.114 * b) * yScale);
-    uint8_t U = (uint8_t)((0.492 * (b - Y) + 128) * uScale);
-    uint8_t V = (uint8_t)((0.877 * (r - Y) + 128) * vScale);
-    return (a << 24) | (Y << 16) | (U << 8) | V;
+void decodeRow24(const uint8_t *source, uint32_t *destination, int count, const BMPInfo *info) {
+    for (int x = 0; x < count; x++, source += 3)
+        destination[x] = 0xFF000000 | (source[2] << 16) | (source[1] << 8) | source[0];
 }
 
-uint32_t YIQColor(uint32_t pixel) {
-    uint8_t a = (pixel >> 24) & 0xFF;
-    uint8_t r = (pixel >> 16) & 0xFF;
-    uint8_t g = (pixel >> 8) & 0xFF;
-    uint8_t b = pixel & 0xFF;
-    uint8_t Y = (uint8_t)((0.299 * r + 0.587 * g + 0.114 * b) * yiqYScale);
-    uint8_t I = (uint8_t)((0.596 * r - 0.275 * g - 0.321 * b + 128) * iScale);
-    uint8_t Q = (uint8_t)((0.212 * r - 0.523 * g + 0.311 * b + 128) * qScale);
-    return (a << 24) | (Y << 16) | (I << 8) | Q;
+void decodeRow32(const uint8_t *source, uint32_t *destination, int count, const BMPInfo *info) {
+    const uint8_t *order = info->shuffle;
+    uint32_t alphaFill = (order[3] & 0x80) ? 0xFF000000 : 0;
+    for (int x = 0; x < count; x++, source += 4) {
+        uint32_t pixel = source[order[0]] | (source[order[1]] << 8) | (source[order[2]] << 16);
+        if (!alphaFill)
+            pixel |= (uint32_t)source[order[3]] << 24;
+        destination[x] = pixel | alphaFill;
+    }
 }
 
-uint32_t CMYColor(uint32_t pixel) {
-    uint8_t a = (pixel >> 24) & 0xFF;
-    uint8_t r = (pixel >> 16) & 0xFF;
-    uint8_t g = (pixel >> 8) & 0xFF;
-    uint8_t b = pixel & 0xFF;
-    uint8_t C = 255 - r;
-    uint8_t M = 255 - g;
-    uint8_t Y = 255 - b;
-    C = (uint8_t)(C * cScale);
-    M = (uint8_t)(M * mScale);
-    Y = (uint8_t)(Y * yCmyScale);
-    r = 255 - C;
-    g = 255 - M;
-    b = 255 - Y;
-    return (a << 24) | (r << 16) | (g << 8) | b;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_SIMD 1
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+void decodeRow24SSSE3(const uint8_t *source, uint32_t *destination, int count, const BMPInfo *info) {
+    const __m128i control = _mm_loadu_si128((const __m128i *)info->shuffle);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    int x = 0;
+    for (; x + 16 <= count; x += 16, source += 48) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)source);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(source + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(source + 32));
+        __m128i p0 = _mm_shuffle_epi8(v0, control);
+        __m128i p1 = _mm_shuffle_epi8(_mm_alignr_epi8(v1, v0, 12), control);
+        __m128i p2 = _mm_shuffle_epi8(_mm_alignr_epi8(v2, v1, 8), control);
+        __m128i p3 = _mm_shuffle_epi8(_mm_srli_si128(v2, 4), control);
+        _mm_storeu_si128((__m128i *)(destination + x), _mm_or_si128(p0, alpha));
+        _mm_storeu_si128((__m128i *)(destination + x + 4), _mm_or_si128(p1, alpha));
+        _mm_storeu_si128((__m128i *)(destination + x + 8), _mm_or_si128(p2, alpha));
+        _mm_storeu_si128((__m128i *)(destination + x + 12), _mm_or_si128(p3, alpha));
+    }
+    decodeRow24(source, destination + x, count - x, info);
 }
 
-uint32_t MonochromeColor(uint32_t pixel) {
-    uint8_t r = (pixel >> 16) & 0xFF;
-    uint8_t g = (pixel >> 8) & 0xFF;
-    uint8_t b = pixel & 0xFF;
-    uint8_t Y = (uint8_t)(0.299 * r + 0.587 * g + 0.114 * b);
-    return (Y > 128) ? 0xFFFFFFFF : 0xFF000000;
+__attribute__((target("ssse3")))
+void decodeRow32SSSE3(const uint8_t *source, uint32_t *destination, int count, const BMPInfo *info) {
+    const __m128i control = _mm_loadu_si128((const __m128i *)info->shuffle);
+    const __m128i alpha = _mm_set1_epi32((info->shuffle[3] & 0x80) ? (int)0xFF000000 : 0);
+    int x = 0;
+    for (; x + 8 <= count; x += 8, source += 32) {
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)source), control);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(source + 16)), control);
+        _mm_storeu_si128((__m128i *)(destination + x), _mm_or_si128(p0, alpha));
+        _mm_storeu_si128((__m128i *)(destination + x + 4), _mm_or_si128(p1, alpha));
+    }
+    decodeRow32(source, destination + x, count - x, info);
 }
+#endif
 
-uint32_t *Dithered1BitColor(uint32_t *pixels, int width, int height) {
-    int newWidth = width * 2;
-    int newHeight = height * 2;
-    uint32_t *ditheredPixels = (uint32_t *)malloc(newWidth * newHeight * sizeof(uint32_t));
-    if (!ditheredPixels) {
-        printf("Memory allocation failed for dithering.");
-        return NULL;
+RowDecoder selectRowDecoder(const BMPInfo *info) {
+    boolean ssse3 = FALSE;
+#ifdef X86_SIMD
+    ssse3 = SDL_HasSSSE3() ? TRUE : FALSE;
+#endif
+    switch (info->bitsPerPixel) {
+    case 8:
+        return decodeRow8;
+    case 24:
+#ifdef X86_SIMD
+        if (ssse3)
+            return decodeRow24SSSE3;
+#endif
+        return decodeRow24;
+    default:
+#ifdef X86_SIMD
+        if (ssse3)
+            return decodeRow32SSSE3;
+#endif
+        return decodeRow32;
     }
-    float errorMatrix[height + 1][width + 1];
-    memset(errorMatrix, 0, sizeof(errorMatrix));
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int index = y * width + x;
-            uint32_t pixel = pixels[index];
-            uint8_t r = (pixel >> 16) & 0xFF;
-            uint8_t g = (pixel >> 8) & 0xFF;
-            uint8_t b = pixel & 0xFF;
-            float gray = 0.299f * r + 0.587f * g + 0.114f * b + errorMatrix[y][x];
-            uint8_t quantized = (gray >= 128) ? 255 : 0;
-            float error = gray - quantized;
-            uint32_t outputColor = (quantized == 255) ? 0xFFFFFFFF : 0xFF000000;
-            ditheredPixels[(y * 2) * newWidth + (x * 2)] = outputColor;
-            ditheredPixels[(y * 2) * newWidth + (x * 2 + 1)] = outputColor;
-            ditheredPixels[(y * 2 + 1) * newWidth + (x * 2)] = outputColor;
-            ditheredPixels[(y * 2 + 1) * newWidth + (x * 2 + 1)] = outputColor;
-            if (x + 1 < width) errorMatrix[y][x + 1] += error * 7.0f / 16.0f;
-            if (y + 1 < height && x > 0) errorMatrix[y + 1][x - 1] += error * 3.0f / 16.0f;
-            if (y + 1 < height) errorMatrix[y + 1][x] += error * 5.0f / 16.0f;
-            if (y + 1 < height && x + 1 < width) errorMatrix[y + 1][x + 1] += error * 1.0f / 16.0f;
+}
+
+image decodeBMP(const uint8_t *data, size_t size, LoadProgress *progress) {
+    BMPInfo info;
+    if (!parseBMPHeader(data, size, &info))
+        return (image){0, 0, NULL};
+    uint32_t *pixelArray = (uint32_t *)countedMalloc((size_t)info.width * info.height * sizeof(uint32_t));
+    if (pixelArray == NULL) {
+        printf("Memory allocation failed for the loaded image!\n");
+        return (image){0, 0, NULL};
+    }
+    RowDecoder decodeRow = selectRowDecoder(&info);
+    boolean checkAlpha = (info.bitsPerPixel == 32 && !info.hasAlpha) ? TRUE : FALSE;
+    uint32_t alphaBits = 0;
+    for (int y = 0; y < info.height; y++) {
+        if (y % LOAD_PROGRESS_ROWS == 0) {
+            if (loadCancelled(progress)) {
+                free(pixelArray);
+                return (image){0, 0, NULL};
+            }
+            reportProgress(progress, 500, y, info.height);
+        }
+        int sourceRow = info.topDown ? y : info.height - 1 - y;
+        uint32_t *row = pixelArray + (size_t)y * info.width;
+        decodeRow(data + info.pixelOffset + (size_t)sourceRow * info.rowStride, row, info.width, &info);
+        if (checkAlpha) {
+            for (int x = 0; x < info.width; x++)
+                alphaBits |= row[x];
         }
     }
-    return ditheredPixels;
+    if (checkAlpha && (alphaBits >> 24) == 0) {
+        size_t count = (size_t)info.width * info.height;
+        for (size_t i = 0; i < count; i++)
+            pixelArray[i] |= 0xFF000000;
+    }
+    return (image){info.width, info.height, pixelArray};
 }
 
-uint32_t EightBitColor(uint32_t pixel) {
-    uint8_t r = (pixel >> 16) & 0xFF;
-    uint8_t g = (pixel >> 8) & 0xFF;
-    uint8_t b = pixel & 0xFF;
-    uint8_t index = ((r & 0xE0) >> 5) << 5 | ((g & 0xE0) >> 5) << 2 | ((b & 0xC0) >> 6);
-    return EightBitPalette[index];
+image loadImageWithSDL(const char *filePath) {
+    SDL_Surface *loadedSurface = SDL_LoadBMP(filePath);
+    if (loadedSurface == NULL) {
+        printf("The image failed to load, SDL_ERROR: %s\n", SDL_GetError());
+        return (image){0, 0, NULL};
+    }
+    SDL_Surface *imageSurface = SDL_ConvertSurfaceFormat(loadedSurface, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(loadedSurface);
+    if (imageSurface == NULL) {
+        printf("The image failed to convert, SDL_ERROR: %s\n", SDL_GetError());
+        return (image){0, 0, NULL};
+    }
+    int width = imageSurface->w;
+    int height = imageSurface->h;
+    uint32_t *pixelArray = (uint32_t *)countedMalloc((size_t)width * height * sizeof(uint32_t));
+    if (pixelArray == NULL) {
+        printf("Memory allocation failed for the loaded image!\n");
+        SDL_FreeSurface(imageSurface);
+        return (image){0, 0, NULL};
+    }
+    for (int y = 0; y < height; y++)
+        memcpy(pixelArray + (size_t)y * width, (uint8_t *)imageSurface->pixels + (size_t)y * imageSurface->pitch, width * sizeof(uint32_t));
+    SDL_FreeSurface(imageSurface);
+    return (image){width, height, pixelArray};
 }
 
-void displayImageInARGB(API *_API, image _image, Point point) {
-    applyImageMovement(_API->pixels, _image, point, ARGBColor);
+image loadImageReporting(const char *filePath, LoadProgress *progress) {
+    FILE *file = fopen(filePath, "rb");
+    if (file == NULL) {
+        printf("The image failed to load, cannot open %s\n", filePath);
+        return (image){0, 0, NULL};
+    }
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = (fileSize > 0) ? (uint8_t *)countedMalloc(fileSize) : NULL;
+    size_t bytesRead = 0;
+    while (data && bytesRead < (size_t)fileSize && !loadCancelled(progress)) {
+        size_t chunk = ((size_t)fileSize - bytesRead < LOAD_READ_CHUNK) ? (size_t)fileSize - bytesRead : LOAD_READ_CHUNK;
+        if (fread(data + bytesRead, 1, chunk, file) != chunk)
+            break;
+        bytesRead += chunk;
+        reportProgress(progress, 0, bytesRead, fileSize);
+    }
+    fclose(file);
+    if (loadCancelled(progress)) {
+        free(data);
+        return (image){0, 0, NULL};
+    }
+    if (data == NULL || bytesRead != (size_t)fileSize) {
+        free(data);
+        return loadImageWithSDL(filePath);
+    }
+    image decoded = decodeBMP(data, fileSize, progress);
+    free(data);
+    if (decoded.pixelArray == NULL && !loadCancelled(progress))
+        return loadImageWithSDL(filePath);
+    return decoded;
 }
 
-void displayImageInYUV(API *_API, image _image, Point point) {
-    applyImageMovement(_API->pixels, _image, point, YUVColor);
+image loadImage(const char *filePath) {
+    return loadImageReporting(filePath, NULL);
 }
 
-void displayImageInYIQ(API *_API, image _image, Point point) {
-    applyImageMovement(_API->pixels, _image, point, YIQColor);
+// TILED IMAGES: a BMP whose decoded pixels would not fit the asset budget is
+// kept as a read-only file mapping (positional reads where mmap is missing)
+// and decoded in TILE_SIZE square tiles when a view needs them. A tile of
+// level k covers 2^k x 2^k source pixels per pixel and averages four samples
+// spread over that block, so a zoomed-out view reads roughly as many file
+// bytes as it shows. The tiles of every open image share one LRU cache.
+#define TILE_SHIFT 8
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_CACHE_SLOTS 256
+#define TILE_LEVELS 16
+#define TILE_GATHER_SPAN 8
+#define BMP_HEADER_BYTES 2048
+
+struct TiledImage {
+    BMPInfo info;
+    RowDecoder decodeRow;
+    const uint8_t *mapping;
+    size_t mappingSize;
+    FILE *file;
+    SDL_mutex *fileLock;
+};
+
+typedef struct {
+    TiledImage *owner;
+    int level;
+    int tileX;
+    int tileY;
+    int width;
+    int height;
+    uint32_t *pixels;
+    Uint32 lastUsed;
+} Tile;
+
+static Tile tileCache[TILE_CACHE_SLOTS];
+static Uint32 tileClock = 0;
+
+static boolean seekFile(FILE *file, uint64_t position) {
+#ifdef _WIN32
+    return (_fseeki64(file, (__int64)position, SEEK_SET) == 0) ? TRUE : FALSE;
+#else
+    return (fseeko(file, (off_t)position, SEEK_SET) == 0) ? TRUE : FALSE;
+#endif
 }
 
-void displayImageInCMY(API *_API, image _image, Point point) {
-    applyImageMovement(_API->pixels, _image, point, CMYColor);
+static uint64_t fileLength(FILE *file) {
+#ifdef _WIN32
+    if (_fseeki64(file, 0, SEEK_END) != 0)
+        return 0;
+    __int64 length = _ftelli64(file);
+#else
+    if (fseeko(file, 0, SEEK_END) != 0)
+        return 0;
+    off_t length = ftello(file);
+#endif
+    return (length > 0) ? (uint64_t)length : 0;
 }
 
-void displayImageInMonochrome(API *_API, image _image, Point point) {
-    applyImageMovement(_API->pixels, _image, point, MonochromeColor);
+// Only the headers and the palette are read, so the size of a file can be
+// checked before deciding how to load it.
+boolean readBMPInfoFromFile(FILE *file, BMPInfo *info) {
+    uint8_t header[BMP_HEADER_BYTES];
+    uint64_t length = fileLength(file);
+    size_t count = (length < sizeof(header)) ? (size_t)length : sizeof(header);
+    if (count < 18 || !seekFile(file, 0) || fread(header, 1, count, file) != count)
+        return FALSE;
+    if (count == sizeof(header) && 14 + (uint64_t)readLE32(header + 14) + 16 + 256 * 4 > sizeof(header))
+        return FALSE;
+    return parseBMPHeader(header, (size_t)length, info);
 }
 
-void displayImageInDithered1Bit(API *_API, image _image, Point point) {
-    uint32_t *ditheredPixels = Dithered1BitColor(_image.pixelArray, _image.width, _image.height);
-    if (ditheredPixels) {
-        image ditheredImage = {_image.width * 2, _image.height * 2, ditheredPixels};
-        applyImageMovement(_API->pixels, ditheredImage, point, ARGBColor); 
-        free(ditheredPixels);
-    }
+boolean readBMPInfo(const char *filePath, BMPInfo *info) {
+    FILE *file = fopen(filePath, "rb");
+    if (file == NULL)
+        return FALSE;
+    boolean parsed = readBMPInfoFromFile(file, info);
+    fclose(file);
+    return parsed;
 }
 
-void displayImageIn8Bit(API *_API, image _image, Point point) {
-    applyImageMovement(_API->pixels, _image, point, EightBitColor);
-}
-
-void computeHistogram(image img, int histogram[256]) {
-    memset(histogram, 0, sizeof(int) * 256);
-    for (int y = 0; y < img.height; y++) {
-        for (int x = 0; x < img.width; x++) {
-            uint32_t pixel = img.pixelArray[y * img.width + x];
-            uint8_t intensity = 0;
-            switch (currentDisplay) {
-            case DISPLAY_ARGB: {
-                    uint8_t r = (uint8_t)(((pixel >> 16) & 0xFF) * redScale);
-                    uint8_t g = (uint8_t)(((pixel >> 8) & 0xFF) * greenScale);
-                    uint8_t b = (uint8_t)((pixel & 0xFF) * blueScale);
-                    intensity = (r + g + b) / 3;
-                }
-                break;
-            case DISPLAY_YUV: {
-                    uint8_t r = (uint8_t)(((pixel >> 16) & 0xFF) * redScale);
-                    uint8_t g = (uint8_t)(((pixel >> 8) & 0xFF) * greenScale);
-                    uint8_t b = (uint8_t)((pixel & 0xFF) * blueScale);
-                    intensity = (uint8_t)((0.299 * r + 0.587 * g + 0.114 * b) * yScale);
-                }
-                break;
-            case DISPLAY_YIQ: {
-                    uint8_t r = (uint8_t)(((pixel >> 16) & 0xFF) * redScale);
-                    uint8_t g = (uint8_t)(((pixel >> 8) & 0xFF) * greenScale);
-                    uint8_t b = (uint8_t)((pixel & 0xFF) * blueScale);
-                    intensity = (uint8_t)((0.299 * r + 0.587 * g + 0.114 * b) * yiqYScale);
-                }
-                break;
-            case DISPLAY_CMY: {
-                    uint8_t r = (uint8_t)(((pixel >> 16) & 0xFF) * redScale);
-                    uint8_t g = (uint8_t)(((pixel >> 8) & 0xFF) * greenScale);
-                    uint8_t b = (uint8_t)((pixel & 0xFF) * blueScale);
-                    intensity = (uint8_t)((255 - r + 255 - g + 255 - b) / 3);
-                }
-                break;
-            case DISPLAY_MONOCHROME:
-            case DISPLAY_DITHERED:
-                intensity = (uint8_t)((pixel & 0xFF) * yScale);
-                break;
-            case DISPLAY_8BIT:
-                intensity = (pixel & 0xFF);
-                break;
-            }
-            histogram[intensity]++;
-        }
+image openTiledImage(const char *filePath) {
+    FILE *file = fopen(filePath, "rb");
+    if (file == NULL) {
+        printf("The image failed to load, cannot open %s\n", filePath);
+        return (image){0, 0, NULL};
     }
+    TiledImage *store = (TiledImage *)countedCalloc(1, sizeof(TiledImage));
+    if (store == NULL || !readBMPInfoFromFile(file, &store->info)) {
+        printf("%s cannot be opened as a tiled image.\n", filePath);
+        fclose(file);
+        free(store);
+        return (image){0, 0, NULL};
+    }
+    // Whether a 32-bit file without an alpha mask uses its fourth byte is
+    // only known after reading every pixel, so tiled images treat it as
+    // padding.
+    BMPInfo *info = &store->info;
+    if (info->bitsPerPixel == 32 && !info->hasAlpha) {
+        for (int pixel = 0; pixel < 4; pixel++)
+            info->shuffle[pixel * 4 + 3] = 0x80;
+    }
+    store->decodeRow = selectRowDecoder(info);
+#ifndef _WIN32
+    uint64_t length = fileLength(file);
+    void *mapping = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (mapping != MAP_FAILED) {
+        store->mapping = (const uint8_t *)mapping;
+        store->mappingSize = (size_t)length;
+        fclose(file);
+        file = NULL;
+    }
+#endif
+    if (file) {
+        store->file = file;
+        store->fileLock = SDL_CreateMutex();
+    }
+    return (image){info->width, info->height, NULL, store};
 }
 
-void drawNumber(API *_API, image numbers, Point start, const char *text) {
-    if (numbers.pixelArray == NULL) {
-        printf("Number image not loaded.\n");
+void closeTiledImage(TiledImage *store) {
+    if (store == NULL)
         return;
+    for (int i = 0; i < TILE_CACHE_SLOTS; i++) {
+        if (tileCache[i].owner == store) {
+            tileCache[i].owner = NULL;
+            tileCache[i].lastUsed = 0;
+        }
     }
-    int charWidth = numbers.width / 10;
-    int charHeight = numbers.height;
-    int spaceWidth = charWidth * 1.25;
-    Point position = start;
-    for (const char *c = text; *c != '\0'; c++) {
-        if (*c == ' ') {
-            position.x += spaceWidth;
+#ifndef _WIN32
+    if (store->mapping)
+        munmap((void *)store->mapping, store->mappingSize);
+#endif
+    if (store->file)
+        fclose(store->file);
+    if (store->fileLock)
+        SDL_DestroyMutex(store->fileLock);
+    free(store);
+}
+
+void disposeTileCache() {
+    for (int i = 0; i < TILE_CACHE_SLOTS; i++)
+        free(tileCache[i].pixels);
+    memset(tileCache, 0, sizeof(tileCache));
+}
+
+int tiledLevelExtent(int extent, int level) {
+    return ((extent - 1) >> level) + 1;
+}
+
+// Returns `length` bytes of image row y starting at byte `offset`, either
+// straight from the mapping or read into scratch.
+const uint8_t *tiledRowBytes(TiledImage *store, int y, size_t offset, size_t length, uint8_t *scratch) {
+    int fileRow = store->info.topDown ? y : store->info.height - 1 - y;
+    uint64_t position = store->info.pixelOffset + (uint64_t)fileRow * store->info.rowStride + offset;
+    if (store->mapping)
+        return store->mapping + position;
+    SDL_LockMutex(store->fileLock);
+    boolean read = (seekFile(store->file, position) && fread(scratch, 1, length, store->file) == length) ? TRUE : FALSE;
+    SDL_UnlockMutex(store->fileLock);
+    return read ? scratch : NULL;
+}
+
+void decodeTile(void *context, int index) {
+    Tile *tile = ((Tile **)context)[index];
+    TiledImage *store = tile->owner;
+    const BMPInfo *info = &store->info;
+    int step = 1 << tile->level;
+    int half = step >> 1;
+    int bytesPerPixel = info->bitsPerPixel / 8;
+    int firstX = (tile->tileX << TILE_SHIFT) * step;
+    int lastX = ((tile->tileX << TILE_SHIFT) + tile->width - 1) * step + half;
+    if (lastX >= info->width)
+        lastX = info->width - 1;
+    size_t offset = (size_t)firstX * bytesPerPixel;
+    size_t length = (size_t)(lastX - firstX + 1) * bytesPerPixel;
+    uint8_t *scratch = NULL;
+    if (store->mapping == NULL)
+        scratch = (uint8_t *)countedMalloc(length * 2);
+    for (int j = 0; j < tile->height; j++) {
+        uint32_t *destination = tile->pixels + (j << TILE_SHIFT);
+        int y = ((tile->tileY << TILE_SHIFT) + j) * step;
+        int y1 = (y + half < info->height) ? y + half : info->height - 1;
+        const uint8_t *row0 = NULL;
+        const uint8_t *row1 = NULL;
+        if (store->mapping || scratch) {
+            row0 = tiledRowBytes(store, y, offset, length, scratch);
+            row1 = (step > 1) ? tiledRowBytes(store, y1, offset, length, scratch ? scratch + length : NULL) : row0;
+        }
+        if (row0 == NULL || row1 == NULL) {
+            for (int i = 0; i < tile->width; i++)
+                destination[i] = 0xFF000000;
             continue;
         }
-        if (*c >= '0' && *c <= '9') {
-            int index = *c - '0';
-            int rightMostPixel = 0;
-            for (uint16_t y = 0; y < charHeight; y++) {
-                for (uint16_t x = 0; x < charWidth; x++) {
-                    uint32_t screenX = position.x + x;
-                    uint32_t screenY = position.y + y;
-                    uint32_t srcX = index * charWidth + x;
-                    uint32_t srcY = y;
-                    uint32_t pixel = numbers.pixelArray[srcY * numbers.width + srcX];
-                    uint8_t r = (pixel >> 16) & 0xFF;
-                    uint8_t g = (pixel >> 8) & 0xFF;
-                    uint8_t b = pixel & 0xFF;
-                    if (r > 200 && g > 200 && b > 200) {
-                        continue;
-                    }
-                    if (screenX < SCREEN_WIDTH && screenY < SCREEN_HEIGHT) {
-                        _API->pixels[screenY * SCREEN_WIDTH + screenX] = 0xFF000000;
-                        if (x > rightMostPixel) {
-                            rightMostPixel = x;
-                        }
-                    }
-                }
-            }
-            position.x += rightMostPixel + 2;
+        if (step == 1) {
+            store->decodeRow(row0, destination, tile->width, info);
+            continue;
+        }
+        for (int i = 0; i < tile->width; i++) {
+            int x0 = i * step;
+            int x1 = (firstX + x0 + half <= lastX) ? x0 + half : lastX - firstX;
+            uint32_t samples[4];
+            store->decodeRow(row0 + (size_t)x0 * bytesPerPixel, &samples[0], 1, info);
+            store->decodeRow(row0 + (size_t)x1 * bytesPerPixel, &samples[1], 1, info);
+            store->decodeRow(row1 + (size_t)x0 * bytesPerPixel, &samples[2], 1, info);
+            store->decodeRow(row1 + (size_t)x1 * bytesPerPixel, &samples[3], 1, info);
+            destination[i] = averageFour(samples[0], samples[1], samples[2], samples[3]);
         }
     }
+    free(scratch);
 }
 
-void drawText(API *_API, image alphabet, Point start, const char *text) {
-    if (alphabet.pixelArray == NULL) {
-        printf("Alphabet image not loaded.\n");
-        return;
+// Makes the tiles of a rectangle of tile indices resident and returns them
+// row by row in grid. Missing tiles replace the least recently used ones
+// and are decoded in parallel; a rectangle larger than the cache fails.
+boolean gatherTiles(TiledImage *store, int level, SDL_Rect area, Tile **grid) {
+    if (area.w <= 0 || area.h <= 0 || area.w * area.h > TILE_CACHE_SLOTS)
+        return FALSE;
+    Uint32 stamp = ++tileClock;
+    int levelWidth = tiledLevelExtent(store->info.width, level);
+    int levelHeight = tiledLevelExtent(store->info.height, level);
+    for (int ty = 0; ty < area.h; ty++) {
+        for (int tx = 0; tx < area.w; tx++) {
+            Tile *found = NULL;
+            for (int i = 0; i < TILE_CACHE_SLOTS && found == NULL; i++) {
+                Tile *tile = &tileCache[i];
+                if (tile->owner == store && tile->level == level && tile->tileX == area.x + tx && tile->tileY == area.y + ty)
+                    found = tile;
+            }
+            if (found)
+                found->lastUsed = stamp;
+            grid[ty * area.w + tx] = found;
+        }
     }
-    int charWidth = alphabet.width / 26;
-    int charHeight = alphabet.height;
-    int spaceWidth = charWidth * 1.25;
-    Point position = start;
-    for (const char *c = text; *c != '\0'; c++) {
-        if (*c == ' ') {
-            position.x += spaceWidth;
+    Tile *missing[TILE_CACHE_SLOTS];
+    int missingCount = 0;
+    for (int index = 0; index < area.w * area.h; index++) {
+        if (grid[index])
             continue;
-        } if (*c >= 'a' && *c <= 'z') {
-            int index = *c - 'a';
-            int rightMostPixel = 0;
-            for (uint16_t y = 0; y < charHeight; y++) {
-                for (uint16_t x = 0; x < charWidth; x++) {
-                    uint32_t screenX = position.x + x;
-                    uint32_t screenY = position.y + y;
-                    uint32_t srcX = index * charWidth + x;
-                    uint32_t srcY = y;
-                    uint32_t pixel = alphabet.pixelArray[srcY * alphabet.width + srcX];
-                    uint8_t r = (pixel >> 16) & 0xFF;
-                    uint8_t g = (pixel >> 8) & 0xFF;
-                    uint8_t b = pixel & 0xFF;
-                    if (r > 200 && g > 200 && b > 200) {
-                        continue;
-                    } if (screenX < SCREEN_WIDTH && screenY < SCREEN_HEIGHT) {
-                        _API->pixels[screenY * SCREEN_WIDTH + screenX] = 0xFF000000;
-                        if (x > rightMostPixel) {
-                            rightMostPixel = x;
-                        }
-                    }
+        Tile *victim = NULL;
+        for (int i = 0; i < TILE_CACHE_SLOTS; i++) {
+            if (tileCache[i].lastUsed != stamp && (victim == NULL || tileCache[i].lastUsed < victim->lastUsed))
+                victim = &tileCache[i];
+        }
+        if (victim->pixels == NULL)
+            victim->pixels = (uint32_t *)countedMalloc(TILE_SIZE * TILE_SIZE * sizeof(uint32_t));
+        if (victim->pixels == NULL) {
+            printf("Memory allocation failed for an image tile!\n");
+            return FALSE;
+        }
+        int tileX = area.x + index % area.w;
+        int tileY = area.y + index / area.w;
+        victim->owner = store;
+        victim->level = level;
+        victim->tileX = tileX;
+        victim->tileY = tileY;
+        victim->width = (levelWidth - (tileX << TILE_SHIFT) < TILE_SIZE) ? levelWidth - (tileX << TILE_SHIFT) : TILE_SIZE;
+        victim->height = (levelHeight - (tileY << TILE_SHIFT) < TILE_SIZE) ? levelHeight - (tileY << TILE_SHIFT) : TILE_SIZE;
+        victim->lastUsed = stamp;
+        grid[index] = victim;
+        missing[missingCount++] = victim;
+    }
+    if (missingCount > 0)
+        runParallel(decodeTile, missing, missingCount);
+    return TRUE;
+}
+
+// Copies a rectangle of one level into destination, a few tiles at a time
+// so that regions of any size pass through the cache.
+boolean readTiledRegion(TiledImage *store, int level, SDL_Rect region, uint32_t *destination, int stride) {
+    Tile *grid[TILE_GATHER_SPAN * TILE_GATHER_SPAN];
+    int firstTileX = region.x >> TILE_SHIFT;
+    int lastTileX = (region.x + region.w - 1) >> TILE_SHIFT;
+    int firstTileY = region.y >> TILE_SHIFT;
+    int lastTileY = (region.y + region.h - 1) >> TILE_SHIFT;
+    for (int tileY = firstTileY; tileY <= lastTileY; tileY += TILE_GATHER_SPAN) {
+        for (int tileX = firstTileX; tileX <= lastTileX; tileX += TILE_GATHER_SPAN) {
+            SDL_Rect area = {tileX, tileY, lastTileX - tileX + 1, lastTileY - tileY + 1};
+            if (area.w > TILE_GATHER_SPAN)
+                area.w = TILE_GATHER_SPAN;
+            if (area.h > TILE_GATHER_SPAN)
+                area.h = TILE_GATHER_SPAN;
+            if (!gatherTiles(store, level, area, grid))
+                return FALSE;
+            for (int i = 0; i < area.w * area.h; i++) {
+                Tile *tile = grid[i];
+                SDL_Rect bounds = {tile->tileX << TILE_SHIFT, tile->tileY << TILE_SHIFT, tile->width, tile->height};
+                SDL_Rect overlap;
+                if (!SDL_IntersectRect(&bounds, &region, &overlap))
+                    continue;
+                for (int y = overlap.y; y < overlap.y + overlap.h; y++) {
+                    const uint32_t *source = tile->pixels + ((y - bounds.y) << TILE_SHIFT) + (overlap.x - bounds.x);
+                    memcpy(destination + (size_t)(y - region.y) * stride + (overlap.x - region.x), source, overlap.w * sizeof(uint32_t));
                 }
             }
-            position.x += rightMostPixel + 2;
         }
     }
+    return TRUE;
 }
 
-void drawHistogram(API *_API, int histogram[256], image numbers) {
-    int histX = 40;
-    int histY = 80;
-    int histWidth = SCREEN_WIDTH - 60;
-    int histHeight = 160;
-    int maxFrequency = 1;
-    for (int i = 0; i < 256; i++) {
-        if (histogram[i] > maxFrequency)
-            maxFrequency = histogram[i];
+// Decodes a whole level into memory, for the consumers that need every
+// pixel at once.
+image tiledLevelImage(TiledImage *store, int level) {
+    int width = tiledLevelExtent(store->info.width, level);
+    int height = tiledLevelExtent(store->info.height, level);
+    uint32_t *pixelArray = (uint32_t *)countedMalloc((size_t)width * height * sizeof(uint32_t));
+    if (pixelArray == NULL) {
+        printf("Memory allocation failed for the tiled image level!\n");
+        return (image){0, 0, NULL};
     }
-    for (int y = histY - 30; y < histY + histHeight + 40; y++) {
-        for (int x = histX - 30; x < histX + histWidth + 30; x++) {
-            _API->pixels[y * SCREEN_WIDTH + x] = 0xFFFFFFFF;  
-        }
+    if (!readTiledRegion(store, level, (SDL_Rect){0, 0, width, height}, pixelArray, width)) {
+        free(pixelArray);
+        return (image){0, 0, NULL};
     }
-    for (int i = 0; i <= 255; i += 32) {
-        int gridX = histX + (i * histWidth / 256);
-        for (int y = histY; y < histY + histHeight; y++) {
-            _API->pixels[y * SCREEN_WIDTH + gridX] = 0xFFAAAAAA; 
-        }
+    return (image){width, height, pixelArray};
+}
+
+// ASSET CACHE: images are decoded once and shared by reference count.
+// Unreferenced entries are evicted least recently used first once the
+// budget is exceeded, and a file is reloaded only when its mtime changes.
+// Loads can run on a background loader thread that decodes into the
+// asset's staging image; refreshAssets swaps a finished image in between
+// frames, so the previous image stays on screen until then.
+#define ASSET_CACHE_SLOTS 16
+#define ASSET_RELOAD_INTERVAL_MS 500
+#define ASSET_PROGRESS_INTERVAL_MS 50
+
+typedef enum {
+    LOAD_IDLE,
+    LOAD_QUEUED,
+    LOAD_DONE
+} LoadState;
+
+typedef struct {
+    char path[260];
+    image img;
+    int refCount;
+    time_t modifiedTime;
+    Uint32 lastChecked;
+    Uint32 lastUsed;
+    SDL_atomic_t loadState;
+    LoadProgress progress;
+    image staging;
+    time_t stagingModifiedTime;
+} Asset;
+
+typedef struct {
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *wake;
+    Asset *queue[ASSET_CACHE_SLOTS];
+    int queued;
+    boolean quit;
+    Uint32 loadedEvent;
+} AssetLoader;
+
+static Asset assetCache[ASSET_CACHE_SLOTS];
+static AssetLoader assetLoader;
+static size_t assetMemoryBudget = 256 * 1024 * 1024;
+static size_t assetMemoryUsed = 0;
+static uint32_t assetGeneration = 0;
+
+time_t fileModifiedTime(const char *filePath) {
+    struct stat fileStatus;
+    if (stat(filePath, &fileStatus) != 0)
+        return 0;
+    return fileStatus.st_mtime;
+}
+
+// A tiled image only holds its file mapping; its tiles are budgeted by the
+// tile cache.
+size_t imageBytes(image _image) {
+    if (_image.tiles)
+        return 0;
+    return (size_t)_image.width * _image.height * sizeof(uint32_t);
+}
+
+void releaseImage(image _image) {
+    if (_image.pixelArray) {
+        forgetMipmaps(_image.pixelArray);
+        free(_image.pixelArray);
     }
-    for (int i = 0; i <= 4; i++) {
-        int gridY = histY + histHeight - (i * histHeight / 4);
-        for (int x = histX; x < histX + histWidth; x++) {
-            _API->pixels[gridY * SCREEN_WIDTH + x] = 0xFFAAAAAA;
+    closeTiledImage(_image.tiles);
+}
+
+// Files whose decoded pixels would take more than half of the budget are
+// opened as tiled images instead of being decoded up front.
+image openImage(const char *filePath, LoadProgress *progress) {
+    BMPInfo info;
+    if (readBMPInfo(filePath, &info) && (uint64_t)info.width * info.height * sizeof(uint32_t) > assetMemoryBudget / 2) {
+        image tiled = openTiledImage(filePath);
+        if (tiled.tiles)
+            return tiled;
+    }
+    return loadImageReporting(filePath, progress);
+}
+
+boolean assetLoading(const Asset *asset) {
+    return (asset && SDL_AtomicGet((SDL_atomic_t *)&asset->loadState) != LOAD_IDLE) ? TRUE : FALSE;
+}
+
+void freeAsset(Asset *asset) {
+    assetMemoryUsed -= imageBytes(asset->img);
+    releaseImage(asset->img);
+    memset(asset, 0, sizeof(Asset));
+}
+
+void evictAssets(size_t requiredBytes) {
+    while (assetMemoryUsed + requiredBytes > assetMemoryBudget) {
+        Asset *victim = NULL;
+        for (int i = 0; i < ASSET_CACHE_SLOTS; i++) {
+            Asset *asset = &assetCache[i];
+            if (asset->path[0] == '\0' || asset->refCount > 0 || asset->img.pixelArray == NULL || assetLoading(asset))
+                continue;
+            if (victim == NULL || asset->lastUsed < victim->lastUsed)
+                victim = asset;
         }
+        if (victim == NULL)
+            break;
+        freeAsset(victim);
     }
-    int barWidth = (histWidth / 256) - 1;
-    for (int i = 0; i < 256; i++) {
-        int barHeight = (histogram[i] * histHeight) / maxFrequency;
-        for (int y = histY + histHeight - barHeight; y < histY + histHeight - 1; y++) {
-            for (int x = histX + i * (barWidth + 1); x < histX + i * (barWidth + 1) + barWidth; x++) {
-                _API->pixels[y * SCREEN_WIDTH + x] = 0xFFFF0000;
-            }
+}
+
+void storeAssetImage(Asset *asset, image _image) {
+    assetMemoryUsed -= imageBytes(asset->img);
+    releaseImage(asset->img);
+    asset->img = (image){0, 0, NULL};
+    evictAssets(imageBytes(_image));
+    if (assetMemoryUsed + imageBytes(_image) > assetMemoryBudget)
+        printf("Asset memory budget exceeded while loading %s.\n", asset->path);
+    asset->img = _image;
+    assetMemoryUsed += imageBytes(_image);
+    assetGeneration++;
+}
+
+int assetLoaderThread(void *data) {
+    SDL_LockMutex(assetLoader.lock);
+    while (!assetLoader.quit) {
+        if (assetLoader.queued == 0) {
+            SDL_CondWait(assetLoader.wake, assetLoader.lock);
+            continue;
         }
+        Asset *asset = assetLoader.queue[0];
+        memmove(assetLoader.queue, assetLoader.queue + 1, --assetLoader.queued * sizeof(Asset *));
+        SDL_UnlockMutex(assetLoader.lock);
+        asset->staging = openImage(asset->path, &asset->progress);
+        SDL_AtomicSet(&asset->loadState, LOAD_DONE);
+        SDL_Event event;
+        memset(&event, 0, sizeof(event));
+        event.type = assetLoader.loadedEvent;
+        SDL_PushEvent(&event);
+        SDL_LockMutex(assetLoader.lock);
     }
-    for (int i = 0; i <= 255; i += 64) {
-        char label[4];
-        sprintf(label, "%d", i);  
-        int xPos = histX + (i * histWidth / 256) - 10;
-        int yPos = histY + histHeight + 12; 
-        Point textPos = {(uint16_t)xPos, (uint16_t)yPos};
-        drawNumber(_API, numbers, textPos, label);
+    SDL_UnlockMutex(assetLoader.lock);
+    return 0;
+}
+
+// Loads synchronously when the loader thread cannot be started.
+void queueAssetLoad(Asset *asset, time_t modifiedTime) {
+    asset->stagingModifiedTime = modifiedTime;
+    asset->staging = (image){0, 0, NULL};
+    SDL_AtomicSet(&asset->progress.permille, 0);
+    SDL_AtomicSet(&asset->progress.cancelled, 0);
+    if (assetLoader.thread == NULL) {
+        assetLoader.lock = SDL_CreateMutex();
+        assetLoader.wake = SDL_CreateCond();
+        assetLoader.loadedEvent = SDL_RegisterEvents(1);
+        if (assetLoader.lock && assetLoader.wake && assetLoader.loadedEvent != (Uint32)-1)
+            assetLoader.thread = SDL_CreateThread(assetLoaderThread, "asset loader", NULL);
     }
-    for (int i = 0; i <= 4; i++) {
-        char label[5];
-        int value = (maxFrequency * i) / 4;  
-        sprintf(label, "%d", value);  
-        int xPos = histX - 25;
-        int yPos = histY + histHeight - (i * histHeight / 4) - 5;
-        Point textPos = {(uint16_t)xPos, (uint16_t)yPos};
-        drawNumber(_API, numbers, textPos, label);
+    if (assetLoader.thread == NULL) {
+        asset->staging = openImage(asset->path, NULL);
+        SDL_AtomicSet(&asset->loadState, LOAD_DONE);
+        return;
     }
+    SDL_AtomicSet(&asset->loadState, LOAD_QUEUED);
+    SDL_LockMutex(assetLoader.lock);
+    assetLoader.queue[assetLoader.queued++] = asset;
+    SDL_CondSignal(assetLoader.wake);
+    SDL_UnlockMutex(assetLoader.lock);
 }
-    
-void drawCheckbox(API *_API, Checkbox checkbox) {
-    uint32_t boxColor = checkbox.checked ? 0xFF00AA00 : 0xFFFFFFFF;
-    uint32_t shadowColor = 0xFF404040;
-    int boxSize = 16;
-    for (int y = 2; y < boxSize + 2; y++) {
-        for (int x = 2; x < boxSize + 2; x++) {
-            uint32_t screenX = checkbox.position.x + x;
-            uint32_t screenY = checkbox.position.y + y;
-            if (screenX < SCREEN_WIDTH && screenY < SCREEN_HEIGHT) {
-                _API->pixels[screenY * SCREEN_WIDTH + screenX] = shadowColor;
-            }
+
+void finishAssetLoad(Asset *asset) {
+    if (asset->staging.pixelArray || asset->staging.tiles)
+        storeAssetImage(asset, asset->staging);
+    asset->staging = (image){0, 0, NULL};
+    asset->modifiedTime = asset->stagingModifiedTime;
+    SDL_AtomicSet(&asset->loadState, LOAD_IDLE);
+}
+
+void reloadAssetIfModified(Asset *asset, Uint32 now) {
+    if (asset->refCount > 0 || assetLoading(asset) || now - asset->lastChecked < ASSET_RELOAD_INTERVAL_MS)
+        return;
+    asset->lastChecked = now;
+    time_t modifiedTime = fileModifiedTime(asset->path);
+    if (modifiedTime != asset->modifiedTime)
+        queueAssetLoad(asset, modifiedTime);
+}
+
+void refreshAssets() {
+    Uint32 now = SDL_GetTicks();
+    for (int i = 0; i < ASSET_CACHE_SLOTS; i++) {
+        if (SDL_AtomicGet(&assetCache[i].loadState) == LOAD_DONE)
+            finishAssetLoad(&assetCache[i]);
+        if (assetCache[i].path[0] != '\0')
+            reloadAssetIfModified(&assetCache[i], now);
+    }
+}
+
+// How long the main loop may sleep: short while a load is in flight so
+// its progress keeps moving.
+int assetTimeout() {
+    for (int i = 0; i < ASSET_CACHE_SLOTS; i++) {
+        if (assetLoading(&assetCache[i]))
+            return ASSET_PROGRESS_INTERVAL_MS;
+    }
+    return IDLE_TIMEOUT_MS;
+}
+
+// In the background the asset comes back without an image, which shows up
+// once refreshAssets has swapped it in.
+Asset *acquireAsset(const char *filePath, boolean background) {
+    Uint32 now = SDL_GetTicks();
+    Asset *asset = NULL;
+    for (int i = 0; i < ASSET_CACHE_SLOTS; i++) {
+        if (strcmp(assetCache[i].path, filePath) == 0) {
+            asset = &assetCache[i];
+            break;
         }
     }
-    for (int y = 0; y < boxSize; y++) {
-        for (int x = 0; x < boxSize; x++) {
-            uint32_t screenX = checkbox.position.x + x;
-            uint32_t screenY = checkbox.position.y + y;
-            if ((x == 0 && y == 0) || (x == 0 && y == boxSize - 1) || (x == boxSize - 1 && y == 0) || (x == boxSize - 1 && y == boxSize - 1))
-                continue; 
-            if (screenX < SCREEN_WIDTH && screenY < SCREEN_HEIGHT) {
-                _API->pixels[screenY * SCREEN_WIDTH + screenX] = boxColor;
-            }
+    if (asset) {
+        reloadAssetIfModified(asset, now);
+        if (!background && assetLoading(asset)) {
+            while (SDL_AtomicGet(&asset->loadState) != LOAD_DONE)
+                SDL_Delay(1);
+            finishAssetLoad(asset);
         }
+        asset->refCount++;
+        asset->lastUsed = now;
+        return asset;
     }
-    if (checkbox.checked) {
-        for (int i = 3; i < boxSize - 4; i++) {
-            _API->pixels[(checkbox.position.y + i) * SCREEN_WIDTH + (checkbox.position.x + i)] = 0xFF000000;
-            _API->pixels[(checkbox.position.y + i) * SCREEN_WIDTH + (checkbox.position.x + boxSize - i - 1)] = 0xFF000000;
+    for (int i = 0; i < ASSET_CACHE_SLOTS && asset == NULL; i++) {
+        if (assetCache[i].path[0] == '\0')
+            asset = &assetCache[i];
+    }
+    if (asset == NULL) {
+        for (int i = 0; i < ASSET_CACHE_SLOTS; i++) {
+            if (assetCache[i].refCount == 0 && !assetLoading(&assetCache[i]) && (asset == NULL || assetCache[i].lastUsed < asset->lastUsed))
+                asset = &assetCache[i];
         }
+        if (asset == NULL) {
+            printf("Asset cache is full, cannot load %s.\n", filePath);
+            return NULL;
+        }
+        freeAsset(asset);
+    }
+    snprintf(asset->path, sizeof(asset->path), "%s", filePath);
+    asset->lastChecked = now;
+    if (background) {
+        queueAssetLoad(asset, fileModifiedTime(filePath));
+    } else {
+        asset->modifiedTime = fileModifiedTime(filePath);
+        storeAssetImage(asset, openImage(filePath, NULL));
     }
+    asset->refCount = 1;
+    asset->lastUsed = now;
+    return asset;
 }
 
-void drawButton(API *_API, Button button) {
-    uint32_t boxColor = 0xFFDDDDDD;    
+image assetImage(Asset *asset) {
+    if (asset == NULL)
+        return (image){0, 0, NULL};
+    return asset->img;
+}
+
+// Per mille of the asset's load in flight, or -1 when none is.
+int assetProgress(Asset *asset) {
+    if (!assetLoading(asset))
+        return -1;
+    return SDL_AtomicGet(&asset->progress.permille);
+}
+
+// The least advanced load in flight, in percent, or -1 when none is.
+int loadingPercent() {
+    int percent = -1;
+    for (int i = 0; i < ASSET_CACHE_SLOTS; i++) {
+        int progress = assetProgress(&assetCache[i]);
+        if (progress >= 0 && (percent < 0 || progress / 10 < percent))
+            percent = progress / 10;
+    }
+    return percent;
+}
+
+void releaseAsset(Asset *asset) {
+    if (asset && asset->refCount > 0)
+        asset->refCount--;
+}
+
+// Cancels the loads still in flight and stops the loader before the
+// staging images are freed.
+void disposeAssets() {
+    if (assetLoader.thread) {
+        SDL_LockMutex(assetLoader.lock);
+        for (int i = 0; i < ASSET_CACHE_SLOTS; i++)
+            SDL_AtomicSet(&assetCache[i].progress.cancelled, 1);
+        assetLoader.quit = TRUE;
+        SDL_CondSignal(assetLoader.wake);
+        SDL_UnlockMutex(assetLoader.lock);
+        SDL_WaitThread(assetLoader.thread, NULL);
+    }
+    if (assetLoader.wake)
+        SDL_DestroyCond(assetLoader.wake);
+    if (assetLoader.lock)
+        SDL_DestroyMutex(assetLoader.lock);
+    memset(&assetLoader, 0, sizeof(assetLoader));
+    for (int i = 0; i < ASSET_CACHE_SLOTS; i++) {
+        releaseImage(assetCache[i].staging);
+        if (assetCache[i].path[0] != '\0')
+            freeAsset(&assetCache[i]);
+    }
+}
+
+typedef void (*RowFunction)(const uint32_t *, uint32_t *, int);
+
+// MIP PYRAMID: box-filtered half-size copies of a displayed image, built on
+// demand so that zooming out samples a level close to the screen resolution
+// instead of skipping source pixels. Level 0 is the image itself.
+#define MIP_LEVELS 8
+#define MIP_CACHE_SLOTS 4
+
+typedef struct {
+    const uint32_t *source;
+    int width;
+    int height;
+    image levels[MIP_LEVELS];
+    size_t levelBytes[MIP_LEVELS];
+    int levelCount;
+    Uint32 lastUsed;
+} MipPyramid;
+
+static MipPyramid mipCache[MIP_CACHE_SLOTS];
+static Uint32 mipClock = 0;
+
+void freeMipPyramid(MipPyramid *pyramid) {
+    for (int i = 1; i < pyramid->levelCount; i++) {
+        forgetTransforms(pyramid->levels[i].pixelArray);
+        releaseBuffer(pyramid->levels[i].pixelArray, pyramid->levelBytes[i]);
+    }
+    memset(pyramid, 0, sizeof(MipPyramid));
+}
+
+void forgetMipmaps(const uint32_t *pixels) {
+    for (int i = 0; i < MIP_CACHE_SLOTS; i++) {
+        if (mipCache[i].source != NULL && mipCache[i].source == pixels)
+            freeMipPyramid(&mipCache[i]);
+    }
+}
+
+
+uint32_t averageFour(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t sum = ((a >> shift) & 0xFF) + ((b >> shift) & 0xFF) + ((c >> shift) & 0xFF) + ((d >> shift) & 0xFF);
+        result |= ((sum + 2) >> 2) << shift;
+    }
+    return result;
+}
+
+image downsampleImage(image source, size_t *capacity) {
+    int width = (source.width > 1) ? source.width / 2 : 1;
+    int height = (source.height > 1) ? source.height / 2 : 1;
+    uint32_t *pixelArray = (uint32_t *)acquireBuffer((size_t)width * height * sizeof(uint32_t), capacity);
+    if (pixelArray == NULL) {
+        printf("Memory allocation failed for the mip level!\n");
+        return (image){0, 0, NULL};
+    }
+    for (int y = 0; y < height; y++) {
+        const uint32_t *row0 = source.pixelArray + (size_t)(y * 2) * source.width;
+        const uint32_t *row1 = (y * 2 + 1 < source.height) ? row0 + source.width : row0;
+        uint32_t *destination = pixelArray + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            int x0 = x * 2;
+            int x1 = (x0 + 1 < source.width) ? x0 + 1 : x0;
+            destination[x] = averageFour(row0[x0], row0[x1], row1[x0], row1[x1]);
+        }
+    }
+    return (image){width, height, pixelArray};
+}
+
+image mipLevel(image _image, int level) {
+    MipPyramid *pyramid = NULL;
+    for (int i = 0; i < MIP_CACHE_SLOTS && pyramid == NULL; i++) {
+        if (mipCache[i].source == _image.pixelArray && mipCache[i].width == _image.width && mipCache[i].height == _image.height)
+            pyramid = &mipCache[i];
+    }
+    if (pyramid == NULL) {
+        pyramid = &mipCache[0];
+        for (int i = 1; i < MIP_CACHE_SLOTS; i++) {
+            if (mipCache[i].lastUsed < pyramid->lastUsed)
+                pyramid = &mipCache[i];
+        }
+        freeMipPyramid(pyramid);
+        pyramid->source = _image.pixelArray;
+        pyramid->width = _image.width;
+        pyramid->height = _image.height;
+        pyramid->levels[0] = _image;
+        pyramid->levelCount = 1;
+    }
+    pyramid->lastUsed = ++mipClock;
+    while (pyramid->levelCount <= level) {
+        image previous = pyramid->levels[pyramid->levelCount - 1];
+        if (previous.width == 1 && previous.height == 1)
+            break;
+        size_t capacity;
+        image next = downsampleImage(previous, &capacity);
+        if (next.pixelArray == NULL)
+            break;
+        pyramid->levelBytes[pyramid->levelCount] = capacity;
+        pyramid->levels[pyramid->levelCount++] = next;
+    }
+    return pyramid->levels[(level < pyramid->levelCount) ? level : pyramid->levelCount - 1];
+}
+
+// TRANSFORM CACHE: when zoomed in, every source pixel covers several screen
+// pixels, so converting after sampling repeats the same colour conversion
+// for each of them. The blitter instead converts the sampled level once at
+// source resolution and then only copies from it. An entry is keyed by the
+// pixels, the row function and the parameter version, so panning and
+// zooming reuse it until the mode or a scale changes.
+#define TRANSFORM_CACHE_SLOTS 2
+#define TRANSFORM_BAND_ROWS 32
+#define TRANSFORM_CACHE_RATIO 4
+
+typedef struct {
+    const uint32_t *source;
+    int width;
+    int height;
+    uint32_t generation;
+    RowFunction rowFunction;
+    uint32_t parameters;
+    image result;
+    size_t resultBytes;
+    Uint32 lastUsed;
+} TransformEntry;
+
+typedef struct {
+    image source;
+    uint32_t *destination;
+    RowFunction rowFunction;
+} TransformJob;
+
+static TransformEntry transformCache[TRANSFORM_CACHE_SLOTS];
+static Uint32 transformClock = 0;
+
+void freeTransformEntry(TransformEntry *entry) {
+    releaseBuffer(entry->result.pixelArray, entry->resultBytes);
+    memset(entry, 0, sizeof(TransformEntry));
+}
+
+void forgetTransforms(const uint32_t *pixels) {
+    for (int i = 0; i < TRANSFORM_CACHE_SLOTS; i++) {
+        if (transformCache[i].source != NULL && transformCache[i].source == pixels)
+            freeTransformEntry(&transformCache[i]);
+    }
+}
+
+void disposeTransformCache() {
+    for (int i = 0; i < TRANSFORM_CACHE_SLOTS; i++)
+        freeTransformEntry(&transformCache[i]);
+}
+
+void transformBand(void *context, int band) {
+    TransformJob *job = (TransformJob *)context;
+    int first = band * TRANSFORM_BAND_ROWS;
+    int last = (first + TRANSFORM_BAND_ROWS < job->source.height) ? first + TRANSFORM_BAND_ROWS : job->source.height;
+    for (int y = first; y < last; y++) {
+        size_t offset = (size_t)y * job->source.width;
+        job->rowFunction(job->source.pixelArray + offset, job->destination + offset, job->source.width);
+    }
+}
+
+// Returns the converted image, or an empty one when there is no entry and
+// building one is not worth it: the conversion is only materialised when it
+// costs at most a few frames' worth of direct conversions.
+image transformedLevel(image source, RowFunction rowFunction, boolean build, int visiblePixels) {
+    TransformEntry *entry = NULL;
+    for (int i = 0; i < TRANSFORM_CACHE_SLOTS; i++) {
+        TransformEntry *candidate = &transformCache[i];
+        if (candidate->result.pixelArray && candidate->source == source.pixelArray && candidate->width == source.width &&
+            candidate->height == source.height && candidate->generation == assetGeneration &&
+            candidate->rowFunction == rowFunction && candidate->parameters == parameterVersion) {
+            candidate->lastUsed = ++transformClock;
+            return candidate->result;
+        }
+    }
+    if (!build || rowFunction == CopyRow || (size_t)source.width * source.height > (size_t)visiblePixels * TRANSFORM_CACHE_RATIO)
+        return (image){0, 0, NULL};
+    entry = &transformCache[0];
+    for (int i = 1; i < TRANSFORM_CACHE_SLOTS; i++) {
+        if (transformCache[i].lastUsed < entry->lastUsed)
+            entry = &transformCache[i];
+    }
+    freeTransformEntry(entry);
+    size_t capacity;
+    uint32_t *pixelArray = (uint32_t *)acquireBuffer((size_t)source.width * source.height * sizeof(uint32_t), &capacity);
+    if (pixelArray == NULL)
+        return (image){0, 0, NULL};
+    prepareColorTables();
+    TransformJob job = {source, pixelArray, rowFunction};
+    runParallel(transformBand, &job, (source.height + TRANSFORM_BAND_ROWS - 1) / TRANSFORM_BAND_ROWS);
+    entry->source = source.pixelArray;
+    entry->width = source.width;
+    entry->height = source.height;
+    entry->generation = assetGeneration;
+    entry->rowFunction = rowFunction;
+    entry->parameters = parameterVersion;
+    entry->result = (image){source.width, source.height, pixelArray};
+    entry->resultBytes = capacity;
+    entry->lastUsed = ++transformClock;
+    return entry->result;
+}
+
+// The blitter clips the scaled image against the left pane first and then
+// samples through per-column and per-row source index tables, so the cost
+// is one lookup per visible pixel. Zooming out below 1 reads from the mip
+// level whose size is closest above the scaled size. Tiled images gather
+// the tiles under the visible tables first and sample through a tile grid.
+typedef struct {
+    int *columns;
+    int *rows;
+    int capacity;
+} BlitTables;
+
+static BlitTables blitTables;
+
+boolean reserveBlitTables(int count) {
+    if (count <= blitTables.capacity)
+        return TRUE;
+    int *columns = (int *)countedRealloc(blitTables.columns, count * sizeof(int));
+    if (columns)
+        blitTables.columns = columns;
+    int *rows = (int *)countedRealloc(blitTables.rows, count * sizeof(int));
+    if (rows)
+        blitTables.rows = rows;
+    if (columns == NULL || rows == NULL) {
+        printf("Memory allocation failed for the blit tables!\n");
+        return FALSE;
+    }
+    blitTables.capacity = count;
+    return TRUE;
+}
+
+typedef struct {
+    uint32_t *pixels;
+    image source;
+    const int *columns;
+    const int *rows;
+    int left;
+    int top;
+    int count;
+    RowFunction rowFunction;
+    Tile **grid;
+    SDL_Rect gridArea;
+} BlitJob;
+
+void blitBand(void *context, int firstRow, int lastRow) {
+    BlitJob *job = (BlitJob *)context;
+    for (int y = firstRow; y < lastRow; y++) {
+        int sourceY = job->rows[y - job->top];
+        uint32_t *destinationRow = job->pixels + y * SCREEN_WIDTH + job->left;
+        if (job->grid) {
+            Tile **tileRow = job->grid + ((sourceY >> TILE_SHIFT) - job->gridArea.y) * job->gridArea.w - job->gridArea.x;
+            int rowOffset = (sourceY & (TILE_SIZE - 1)) << TILE_SHIFT;
+            for (int x = 0; x < job->count; x++) {
+                int sourceX = job->columns[x];
+                destinationRow[x] = tileRow[sourceX >> TILE_SHIFT]->pixels[rowOffset + (sourceX & (TILE_SIZE - 1))];
+            }
+        } else {
+            const uint32_t *sourceRow = job->source.pixelArray + (size_t)sourceY * job->source.width;
+            for (int x = 0; x < job->count; x++)
+                destinationRow[x] = sourceRow[job->columns[x]];
+        }
+        job->rowFunction(destinationRow, destinationRow, job->count);
+    }
+}
+
+void disposeBlitter() {
+    for (int i = 0; i < MIP_CACHE_SLOTS; i++)
+        freeMipPyramid(&mipCache[i]);
+    disposeTransformCache();
+    free(blitTables.columns);
+    free(blitTables.rows);
+    memset(&blitTables, 0, sizeof(blitTables));
+}
+
+// The part of the image pane being repainted. It is empty (the whole pane)
+// except while panning repaints the strips that scrolled into view.
+static SDL_Rect paneClip = {0, 0, 0, 0};
+
+SDL_Rect imagePane() {
+    if (!SDL_RectEmpty(&paneClip))
+        return paneClip;
+    return (SDL_Rect){0, 0, SCREEN_WIDTH / 2, SCREEN_HEIGHT};
+}
+
+// Returns the screen rectangle that was drawn.
+SDL_Rect blitImage(uint32_t *pixels, image _image, Point point, float zoom, RowFunction rowFunction) {
+    SDL_Rect drawn = {0, 0, 0, 0};
+    SDL_Rect pane = imagePane();
+    int scaledWidth = (int)(_image.width * zoom);
+    int scaledHeight = (int)(_image.height * zoom);
+    int originX = point.x + imageOffsetX;
+    int originY = point.y + imageOffsetY;
+    int firstX = (originX < pane.x) ? pane.x - originX : 0;
+    int lastX = (originX + scaledWidth > pane.x + pane.w) ? pane.x + pane.w - originX : scaledWidth;
+    int firstY = (originY < pane.y) ? pane.y - originY : 0;
+    int lastY = (originY + scaledHeight > pane.y + pane.h) ? pane.y + pane.h - originY : scaledHeight;
+    if (firstX >= lastX || firstY >= lastY)
+        return drawn;
+    if (!reserveBlitTables(SCREEN_WIDTH > SCREEN_HEIGHT ? SCREEN_WIDTH : SCREEN_HEIGHT))
+        return drawn;
+
+    int level = 0;
+    float levelZoom = zoom;
+    int levelCount = _image.tiles ? TILE_LEVELS : MIP_LEVELS;
+    while (level + 1 < levelCount && levelZoom * 2.0f <= 1.0001f) {
+        levelZoom *= 2.0f;
+        level++;
+    }
+    image source = _image;
+    if (_image.tiles) {
+        source.width = tiledLevelExtent(_image.width, level);
+        source.height = tiledLevelExtent(_image.height, level);
+    } else if (level > 0) {
+        source = mipLevel(_image, level);
+        levelZoom = zoom * _image.width / source.width;
+    }
+
+    int *columns = blitTables.columns;
+    int *rows = blitTables.rows;
+    for (int screenX = firstX; screenX < lastX; screenX++) {
+        int srcX = (int)(screenX / levelZoom);
+        columns[screenX - firstX] = (srcX < source.width) ? srcX : source.width - 1;
+    }
+    for (int screenY = firstY; screenY < lastY; screenY++) {
+        int srcY = (int)(screenY / levelZoom);
+        rows[screenY - firstY] = (srcY < source.height) ? srcY : source.height - 1;
+    }
+
+    if (!_image.tiles) {
+        image transformed = transformedLevel(source, rowFunction, (levelZoom > 1.0f) ? TRUE : FALSE, (lastX - firstX) * (lastY - firstY));
+        if (transformed.pixelArray) {
+            source = transformed;
+            rowFunction = CopyRow;
+        }
+    }
+    BlitJob job = {pixels, source, columns, rows, originX + firstX, originY + firstY, lastX - firstX, rowFunction, NULL, {0, 0, 0, 0}};
+    Tile *grid[TILE_CACHE_SLOTS];
+    if (_image.tiles) {
+        SDL_Rect area = {columns[0] >> TILE_SHIFT, rows[0] >> TILE_SHIFT, 0, 0};
+        area.w = (columns[lastX - firstX - 1] >> TILE_SHIFT) - area.x + 1;
+        area.h = (rows[lastY - firstY - 1] >> TILE_SHIFT) - area.y + 1;
+        if (!gatherTiles(_image.tiles, level, area, grid))
+            return drawn;
+        job.grid = grid;
+        job.gridArea = area;
+    }
+
+    prepareColorTables();
+    runBands(blitBand, &job, originY + firstY, originY + lastY);
+    drawn = (SDL_Rect){originX + firstX, originY + firstY, lastX - firstX, lastY - firstY};
+    return drawn;
+}
+
+void applyImageMovement(uint32_t *pixels, image _image, Point point, RowFunction rowFunction) {
+    blitImage(pixels, _image, point, imageZoom, rowFunction);
+}
+
+// COLOUR KERNELS: whole-row conversions between packed ARGB and packed
+// YUV/YIQ/CMY words using fixed-point coefficients and saturating results.
+// Forward luma/chroma coefficients are Q15, inverse ones Q13 and component
+// scales Q8. SSE2 and AVX2 versions are picked at runtime by colorKernels()
+// and produce exactly the same results as the scalar code.
+typedef struct {
+    int32_t scale[3];
+} ComponentScales;
+
+typedef void (*ForwardKernel)(const uint32_t *, uint32_t *, int, const ComponentScales *);
+typedef void (*InverseKernel)(const uint32_t *, uint32_t *, int);
+
+typedef struct {
+    ForwardKernel argbToYUV;
+    ForwardKernel argbToYIQ;
+    ForwardKernel argbToCMY;
+    InverseKernel yuvToARGB;
+    InverseKernel yiqToARGB;
+    InverseKernel cmyToARGB;
+    boolean vectorized;
+} ColorKernels;
+
+enum {
+    LUMA_R = 9798, LUMA_G = 19235, LUMA_B = 3736,
+    YUV_U = 16122, YUV_V = 28738,
+    YIQ_I_R = 19530, YIQ_I_G = -9011, YIQ_I_B = -10519,
+    YIQ_Q_R = 6947, YIQ_Q_G = -17138, YIQ_Q_B = 10191,
+    YUV_R_V = 9341, YUV_G_U = -3234, YUV_G_V = -4758, YUV_B_U = 16650,
+    YIQ_R_I = 7829, YIQ_R_Q = 5078, YIQ_G_I = -2225, YIQ_G_Q = -5299, YIQ_B_I = -9078, YIQ_B_Q = 13968
+};
+
+ComponentScales componentScales(float first, float second, float third) {
+    float values[3] = {first, second, third};
+    ComponentScales scales;
+    for (int i = 0; i < 3; i++) {
+        float fixed = roundf(values[i] * 256.0f);
+        scales.scale[i] = (int32_t)(fixed > 32767.0f ? 32767.0f : (fixed < -32768.0f ? -32768.0f : fixed));
+    }
+    return scales;
+}
+
+static inline int32_t clampByte(int32_t value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline int32_t applyScale(int32_t value, int32_t scale) {
+    return (value * scale + 128) >> 8;
+}
+
+static inline uint32_t packComponents(uint32_t a, int32_t first, int32_t second, int32_t third) {
+    return (a << 24) | (clampByte(first) << 16) | (clampByte(second) << 8) | clampByte(third);
+}
+
+static inline uint32_t yuvPixel(uint32_t pixel, const ComponentScales *scales) {
+    int32_t r = (pixel >> 16) & 0xFF, g = (pixel >> 8) & 0xFF, b = pixel & 0xFF;
+    int32_t Y = clampByte(applyScale((LUMA_R * r + LUMA_G * g + LUMA_B * b + 16384) >> 15, scales->scale[0]));
+    int32_t U = applyScale(((YUV_U * (b - Y) + 16384) >> 15) + 128, scales->scale[1]);
+    int32_t V = applyScale(((YUV_V * (r - Y) + 16384) >> 15) + 128, scales->scale[2]);
+    return packComponents(pixel >> 24, Y, U, V);
+}
+
+static inline uint32_t yiqPixel(uint32_t pixel, const ComponentScales *scales) {
+    int32_t r = (pixel >> 16) & 0xFF, g = (pixel >> 8) & 0xFF, b = pixel & 0xFF;
+    int32_t Y = applyScale((LUMA_R * r + LUMA_G * g + LUMA_B * b + 16384) >> 15, scales->scale[0]);
+    int32_t I = applyScale(((YIQ_I_R * r + YIQ_I_G * g + YIQ_I_B * b + 16384) >> 15) + 128, scales->scale[1]);
+    int32_t Q = applyScale(((YIQ_Q_R * r + YIQ_Q_G * g + YIQ_Q_B * b + 16384) >> 15) + 128, scales->scale[2]);
+    return packComponents(pixel >> 24, Y, I, Q);
+}
+
+static inline uint32_t cmyPixel(uint32_t pixel, const ComponentScales *scales) {
+    int32_t C = 255 - ((pixel >> 16) & 0xFF), M = 255 - ((pixel >> 8) & 0xFF), Y = 255 - (pixel & 0xFF);
+    return packComponents(pixel >> 24, applyScale(C, scales->scale[0]), applyScale(M, scales->scale[1]), applyScale(Y, scales->scale[2]));
+}
+
+static inline uint32_t inversePixel(uint32_t pixel, int32_t rFirst, int32_t rSecond, int32_t gFirst, int32_t gSecond, int32_t bFirst, int32_t bSecond) {
+    int32_t Y = ((pixel >> 16) & 0xFF) << 13;
+    int32_t first = (int32_t)((pixel >> 8) & 0xFF) - 128, second = (int32_t)(pixel & 0xFF) - 128;
+    return packComponents(pixel >> 24,
+        (Y + rFirst * first + rSecond * second + 4096) >> 13,
+        (Y + gFirst * first + gSecond * second + 4096) >> 13,
+        (Y + bFirst * first + bSecond * second + 4096) >> 13);
+}
+
+void argbToYUVScalar(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    for (int x = 0; x < count; x++)
+        destination[x] = yuvPixel(source[x], scales);
+}
+
+void argbToYIQScalar(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    for (int x = 0; x < count; x++)
+        destination[x] = yiqPixel(source[x], scales);
+}
+
+void argbToCMYScalar(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    for (int x = 0; x < count; x++)
+        destination[x] = cmyPixel(source[x], scales);
+}
+
+void yuvToARGBScalar(const uint32_t *source, uint32_t *destination, int count) {
+    for (int x = 0; x < count; x++)
+        destination[x] = inversePixel(source[x], 0, YUV_R_V, YUV_G_U, YUV_G_V, YUV_B_U, 0);
+}
+
+void yiqToARGBScalar(const uint32_t *source, uint32_t *destination, int count) {
+    for (int x = 0; x < count; x++)
+        destination[x] = inversePixel(source[x], YIQ_R_I, YIQ_R_Q, YIQ_G_I, YIQ_G_Q, YIQ_B_I, YIQ_B_Q);
+}
+
+void cmyToARGBScalar(const uint32_t *source, uint32_t *destination, int count) {
+    for (int x = 0; x < count; x++)
+        destination[x] = source[x] ^ 0x00FFFFFF;
+}
+
+#ifdef X86_SIMD
+// Pixels are split into (b | r << 16) and (g | a << 16) lanes so that one
+// pmaddwd evaluates two terms of a dot product for every pixel.
+#define SSE2 __attribute__((target("sse2")))
+#define PAIR(low, high) ((int32_t)(((uint32_t)(uint16_t)(high) << 16) | (uint16_t)(low)))
+
+SSE2 static inline __m128i clampBytes128(__m128i v) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(v, v), zero);
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+}
+
+SSE2 static inline __m128i scale128(__m128i v, int32_t scale) {
+    return _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(v, _mm_set1_epi32(PAIR(scale, 0))), _mm_set1_epi32(128)), 8);
+}
+
+SSE2 static inline __m128i dot128(__m128i rb, __m128i ga, int32_t r, int32_t g, int32_t b, int shift) {
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(rb, _mm_set1_epi32(PAIR(b, r))), _mm_madd_epi16(ga, _mm_set1_epi32(PAIR(g, 0))));
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (shift - 1))), shift);
+}
+
+SSE2 static inline __m128i pack128(__m128i a, __m128i first, __m128i second, __m128i third) {
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(third, first), _mm_packs_epi32(second, a));
+    __m128i pairs = _mm_unpacklo_epi8(bytes, _mm_srli_si128(bytes, 8));
+    return _mm_unpacklo_epi16(pairs, _mm_srli_si128(pairs, 8));
+}
+
+SSE2 void argbToYUVSSE2(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    const __m128i mask = _mm_set1_epi32(0x00FF00FF), low = _mm_set1_epi32(0xFF), bias = _mm_set1_epi32(128);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(source + x));
+        __m128i rb = _mm_and_si128(p, mask), ga = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+        __m128i Y = clampBytes128(scale128(dot128(rb, ga, LUMA_R, LUMA_G, LUMA_B, 15), scales->scale[0]));
+        __m128i b = _mm_and_si128(p, low), r = _mm_srli_epi32(rb, 16);
+        __m128i U = _mm_madd_epi16(_mm_sub_epi32(b, Y), _mm_set1_epi32(PAIR(YUV_U, 0)));
+        __m128i V = _mm_madd_epi16(_mm_sub_epi32(r, Y), _mm_set1_epi32(PAIR(YUV_V, 0)));
+        U = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(U, _mm_set1_epi32(16384)), 15), bias);
+        V = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(V, _mm_set1_epi32(16384)), 15), bias);
+        __m128i result = pack128(_mm_srli_epi32(p, 24), Y, scale128(U, scales->scale[1]), scale128(V, scales->scale[2]));
+        _mm_storeu_si128((__m128i *)(destination + x), result);
+    }
+    argbToYUVScalar(source + x, destination + x, count - x, scales);
+}
+
+SSE2 void argbToYIQSSE2(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    const __m128i mask = _mm_set1_epi32(0x00FF00FF), bias = _mm_set1_epi32(128);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(source + x));
+        __m128i rb = _mm_and_si128(p, mask), ga = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+        __m128i Y = dot128(rb, ga, LUMA_R, LUMA_G, LUMA_B, 15);
+        __m128i I = _mm_add_epi32(dot128(rb, ga, YIQ_I_R, YIQ_I_G, YIQ_I_B, 15), bias);
+        __m128i Q = _mm_add_epi32(dot128(rb, ga, YIQ_Q_R, YIQ_Q_G, YIQ_Q_B, 15), bias);
+        __m128i result = pack128(_mm_srli_epi32(p, 24), scale128(Y, scales->scale[0]), scale128(I, scales->scale[1]), scale128(Q, scales->scale[2]));
+        _mm_storeu_si128((__m128i *)(destination + x), result);
+    }
+    argbToYIQScalar(source + x, destination + x, count - x, scales);
+}
+
+SSE2 void argbToCMYSSE2(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    const __m128i mask = _mm_set1_epi32(0x00FF00FF), invert = _mm_set1_epi32(0x00FFFFFF);
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        __m128i p = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(source + x)), invert);
+        __m128i cy = _mm_and_si128(p, mask), ma = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+        __m128i C = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(cy, _mm_set1_epi32(PAIR(0, scales->scale[0]))), _mm_set1_epi32(128)), 8);
+        __m128i M = scale128(_mm_and_si128(ma, _mm_set1_epi32(0xFF)), scales->scale[1]);
+        __m128i Y = scale128(_mm_and_si128(cy, _mm_set1_epi32(0xFF)), scales->scale[2]);
+        _mm_storeu_si128((__m128i *)(destination + x), pack128(_mm_srli_epi32(p, 24), C, M, Y));
+    }
+    argbToCMYScalar(source + x, destination + x, count - x, scales);
+}
+
+SSE2 static inline void inverse128(const uint32_t *source, uint32_t *destination, int count, const int32_t coefficients[6]) {
+    const __m128i low = _mm_set1_epi32(0xFF), bias = _mm_set1_epi16(128);
+    for (int x = 0; x < count; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(source + x));
+        __m128i pair = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), low), _mm_slli_epi32(_mm_and_si128(p, low), 16));
+        pair = _mm_sub_epi16(pair, bias);
+        __m128i Y = _mm_add_epi32(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(p, 16), low), 13), _mm_set1_epi32(4096));
+        __m128i r = _mm_srai_epi32(_mm_add_epi32(Y, _mm_madd_epi16(pair, _mm_set1_epi32(PAIR(coefficients[0], coefficients[1])))), 13);
+        __m128i g = _mm_srai_epi32(_mm_add_epi32(Y, _mm_madd_epi16(pair, _mm_set1_epi32(PAIR(coefficients[2], coefficients[3])))), 13);
+        __m128i b = _mm_srai_epi32(_mm_add_epi32(Y, _mm_madd_epi16(pair, _mm_set1_epi32(PAIR(coefficients[4], coefficients[5])))), 13);
+        _mm_storeu_si128((__m128i *)(destination + x), pack128(_mm_srli_epi32(p, 24), r, g, b));
+    }
+}
+
+static const int32_t yuvInverse[6] = {0, YUV_R_V, YUV_G_U, YUV_G_V, YUV_B_U, 0};
+static const int32_t yiqInverse[6] = {YIQ_R_I, YIQ_R_Q, YIQ_G_I, YIQ_G_Q, YIQ_B_I, YIQ_B_Q};
+
+SSE2 void yuvToARGBSSE2(const uint32_t *source, uint32_t *destination, int count) {
+    int vectorCount = count & ~3;
+    inverse128(source, destination, vectorCount, yuvInverse);
+    yuvToARGBScalar(source + vectorCount, destination + vectorCount, count - vectorCount);
+}
+
+SSE2 void yiqToARGBSSE2(const uint32_t *source, uint32_t *destination, int count) {
+    int vectorCount = count & ~3;
+    inverse128(source, destination, vectorCount, yiqInverse);
+    yiqToARGBScalar(source + vectorCount, destination + vectorCount, count - vectorCount);
+}
+
+SSE2 void cmyToARGBSSE2(const uint32_t *source, uint32_t *destination, int count) {
+    const __m128i invert = _mm_set1_epi32(0x00FFFFFF);
+    int x = 0;
+    for (; x + 4 <= count; x += 4)
+        _mm_storeu_si128((__m128i *)(destination + x), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(source + x)), invert));
+    cmyToARGBScalar(source + x, destination + x, count - x);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i clampBytes256(__m256i v) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(v, v), zero);
+    return _mm256_unpacklo_epi16(_mm256_unpacklo_epi8(bytes, zero), zero);
+}
+
+AVX2 static inline __m256i scale256(__m256i v, int32_t scale) {
+    return _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(v, _mm256_set1_epi32(PAIR(scale, 0))), _mm256_set1_epi32(128)), 8);
+}
+
+AVX2 static inline __m256i dot256(__m256i rb, __m256i ga, int32_t r, int32_t g, int32_t b, int shift) {
+    __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(rb, _mm256_set1_epi32(PAIR(b, r))), _mm256_madd_epi16(ga, _mm256_set1_epi32(PAIR(g, 0))));
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(1 << (shift - 1))), shift);
+}
+
+AVX2 static inline __m256i pack256(__m256i a, __m256i first, __m256i second, __m256i third) {
+    __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(third, first), _mm256_packs_epi32(second, a));
+    __m256i pairs = _mm256_unpacklo_epi8(bytes, _mm256_srli_si256(bytes, 8));
+    return _mm256_unpacklo_epi16(pairs, _mm256_srli_si256(pairs, 8));
+}
+
+AVX2 void argbToYUVAVX2(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    const __m256i mask = _mm256_set1_epi32(0x00FF00FF), low = _mm256_set1_epi32(0xFF), bias = _mm256_set1_epi32(128);
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(source + x));
+        __m256i rb = _mm256_and_si256(p, mask), ga = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+        __m256i Y = clampBytes256(scale256(dot256(rb, ga, LUMA_R, LUMA_G, LUMA_B, 15), scales->scale[0]));
+        __m256i b = _mm256_and_si256(p, low), r = _mm256_srli_epi32(rb, 16);
+        __m256i U = _mm256_madd_epi16(_mm256_sub_epi32(b, Y), _mm256_set1_epi32(PAIR(YUV_U, 0)));
+        __m256i V = _mm256_madd_epi16(_mm256_sub_epi32(r, Y), _mm256_set1_epi32(PAIR(YUV_V, 0)));
+        U = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(U, _mm256_set1_epi32(16384)), 15), bias);
+        V = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(V, _mm256_set1_epi32(16384)), 15), bias);
+        __m256i result = pack256(_mm256_srli_epi32(p, 24), Y, scale256(U, scales->scale[1]), scale256(V, scales->scale[2]));
+        _mm256_storeu_si256((__m256i *)(destination + x), result);
+    }
+    argbToYUVSSE2(source + x, destination + x, count - x, scales);
+}
+
+AVX2 void argbToYIQAVX2(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    const __m256i mask = _mm256_set1_epi32(0x00FF00FF), bias = _mm256_set1_epi32(128);
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(source + x));
+        __m256i rb = _mm256_and_si256(p, mask), ga = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+        __m256i Y = dot256(rb, ga, LUMA_R, LUMA_G, LUMA_B, 15);
+        __m256i I = _mm256_add_epi32(dot256(rb, ga, YIQ_I_R, YIQ_I_G, YIQ_I_B, 15), bias);
+        __m256i Q = _mm256_add_epi32(dot256(rb, ga, YIQ_Q_R, YIQ_Q_G, YIQ_Q_B, 15), bias);
+        __m256i result = pack256(_mm256_srli_epi32(p, 24), scale256(Y, scales->scale[0]), scale256(I, scales->scale[1]), scale256(Q, scales->scale[2]));
+        _mm256_storeu_si256((__m256i *)(destination + x), result);
+    }
+    argbToYIQSSE2(source + x, destination + x, count - x, scales);
+}
+
+AVX2 void argbToCMYAVX2(const uint32_t *source, uint32_t *destination, int count, const ComponentScales *scales) {
+    const __m256i mask = _mm256_set1_epi32(0x00FF00FF), invert = _mm256_set1_epi32(0x00FFFFFF);
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        __m256i p = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(source + x)), invert);
+        __m256i cy = _mm256_and_si256(p, mask), ma = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+        __m256i C = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(cy, _mm256_set1_epi32(PAIR(0, scales->scale[0]))), _mm256_set1_epi32(128)), 8);
+        __m256i M = scale256(_mm256_and_si256(ma, _mm256_set1_epi32(0xFF)), scales->scale[1]);
+        __m256i Y = scale256(_mm256_and_si256(cy, _mm256_set1_epi32(0xFF)), scales->scale[2]);
+        _mm256_storeu_si256((__m256i *)(destination + x), pack256(_mm256_srli_epi32(p, 24), C, M, Y));
+    }
+    argbToCMYSSE2(source + x, destination + x, count - x, scales);
+}
+
+AVX2 static inline void inverse256(const uint32_t *source, uint32_t *destination, int count, const int32_t coefficients[6]) {
+    const __m256i low = _mm256_set1_epi32(0xFF), bias = _mm256_set1_epi16(128);
+    for (int x = 0; x < count; x += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(source + x));
+        __m256i pair = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(p, 8), low), _mm256_slli_epi32(_mm256_and_si256(p, low), 16));
+        pair = _mm256_sub_epi16(pair, bias);
+        __m256i Y = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 16), low), 13), _mm256_set1_epi32(4096));
+        __m256i r = _mm256_srai_epi32(_mm256_add_epi32(Y, _mm256_madd_epi16(pair, _mm256_set1_epi32(PAIR(coefficients[0], coefficients[1])))), 13);
+        __m256i g = _mm256_srai_epi32(_mm256_add_epi32(Y, _mm256_madd_epi16(pair, _mm256_set1_epi32(PAIR(coefficients[2], coefficients[3])))), 13);
+        __m256i b = _mm256_srai_epi32(_mm256_add_epi32(Y, _mm256_madd_epi16(pair, _mm256_set1_epi32(PAIR(coefficients[4], coefficients[5])))), 13);
+        _mm256_storeu_si256((__m256i *)(destination + x), pack256(_mm256_srli_epi32(p, 24), r, g, b));
+    }
+}
+
+AVX2 void yuvToARGBAVX2(const uint32_t *source, uint32_t *destination, int count) {
+    int vectorCount = count & ~7;
+    inverse256(source, destination, vectorCount, yuvInverse);
+    yuvToARGBSSE2(source + vectorCount, destination + vectorCount, count - vectorCount);
+}
+
+AVX2 void yiqToARGBAVX2(const uint32_t *source, uint32_t *destination, int count) {
+    int vectorCount = count & ~7;
+    inverse256(source, destination, vectorCount, yiqInverse);
+    yiqToARGBSSE2(source + vectorCount, destination + vectorCount, count - vectorCount);
+}
+
+AVX2 void cmyToARGBAVX2(const uint32_t *source, uint32_t *destination, int count) {
+    const __m256i invert = _mm256_set1_epi32(0x00FFFFFF);
+    int x = 0;
+    for (; x + 8 <= count; x += 8)
+        _mm256_storeu_si256((__m256i *)(destination + x), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(source + x)), invert));
+    cmyToARGBSSE2(source + x, destination + x, count - x);
+}
+#endif
+
+static ColorKernels selectedKernels;
+static SDL_atomic_t colorKernelsSelected;
+
+const ColorKernels *colorKernels() {
+    if (SDL_AtomicGet(&colorKernelsSelected))
+        return &selectedKernels;
+    ColorKernels kernels = {argbToYUVScalar, argbToYIQScalar, argbToCMYScalar, yuvToARGBScalar, yiqToARGBScalar, cmyToARGBScalar, FALSE};
+#ifdef X86_SIMD
+    if (SDL_HasAVX2()) {
+        kernels = (ColorKernels){argbToYUVAVX2, argbToYIQAVX2, argbToCMYAVX2, yuvToARGBAVX2, yiqToARGBAVX2, cmyToARGBAVX2, TRUE};
+    } else if (SDL_HasSSE2()) {
+        kernels = (ColorKernels){argbToYUVSSE2, argbToYIQSSE2, argbToCMYSSE2, yuvToARGBSSE2, yiqToARGBSSE2, cmyToARGBSSE2, TRUE};
+    }
+#endif
+    selectedKernels = kernels;
+    SDL_AtomicSet(&colorKernelsSelected, 1);
+    return &selectedKernels;
+}
+
+// CHANNEL TABLES: every scale stage is a per-channel mapping, so the
+// display path looks it up in tables that are rebuilt only after
+// adjustParameter has bumped parameterVersion. The YUV/YIQ tables are
+// indexed by component + 128 because unscaled V, I and Q leave 0..255.
+typedef struct {
+    uint32_t version;
+    uint32_t argb[4][256];
+    uint32_t cmy[3][256];
+    uint8_t yuv[3][512];
+    uint8_t yiq[3][512];
+} ChannelTables;
+
+static ChannelTables channelTableCache;
+
+const ChannelTables *channelTables() {
+    if (channelTableCache.version == parameterVersion)
+        return &channelTableCache;
+    float argbScales[4] = {alphaScale, redScale, greenScale, blueScale};
+    float cmyScales[3] = {cScale, mScale, yCmyScale};
+    ComponentScales yuvScales = componentScales(yScale, uScale, vScale);
+    ComponentScales yiqScales = componentScales(yiqYScale, iScale, qScale);
+    ComponentScales cmyFixed = componentScales(cmyScales[0], cmyScales[1], cmyScales[2]);
+    for (int v = 0; v < 256; v++) {
+        for (int channel = 0; channel < 4; channel++)
+            channelTableCache.argb[channel][v] = (uint32_t)clampByte((int32_t)(v * argbScales[channel])) << (24 - channel * 8);
+        for (int channel = 0; channel < 3; channel++)
+            channelTableCache.cmy[channel][v] = (uint32_t)(255 - clampByte(applyScale(255 - v, cmyFixed.scale[channel]))) << (16 - channel * 8);
+    }
+    for (int i = 0; i < 512; i++) {
+        for (int component = 0; component < 3; component++) {
+            channelTableCache.yuv[component][i] = (uint8_t)clampByte(applyScale(i - 128, yuvScales.scale[component]));
+            channelTableCache.yiq[component][i] = (uint8_t)clampByte(applyScale(i - 128, yiqScales.scale[component]));
+        }
+    }
+    channelTableCache.version = parameterVersion;
+    return &channelTableCache;
+}
+
+// Builds the lazily initialised tables and kernel choice on the calling
+// thread, before row functions run on the worker pool.
+void prepareColorTables() {
+    channelTables();
+    colorKernels();
+}
+
+static inline uint32_t argbLookup(uint32_t pixel, const ChannelTables *t) {
+    return t->argb[0][pixel >> 24] | t->argb[1][(pixel >> 16) & 0xFF] | t->argb[2][(pixel >> 8) & 0xFF] | t->argb[3][pixel & 0xFF];
+}
+
+static inline uint32_t cmyLookup(uint32_t pixel, const ChannelTables *t) {
+    return (pixel & 0xFF000000) | t->cmy[0][(pixel >> 16) & 0xFF] | t->cmy[1][(pixel >> 8) & 0xFF] | t->cmy[2][pixel & 0xFF];
+}
+
+static inline uint32_t yuvLookup(uint32_t pixel, const ChannelTables *t) {
+    int32_t r = (pixel >> 16) & 0xFF, g = (pixel >> 8) & 0xFF, b = pixel & 0xFF;
+    int32_t Y = t->yuv[0][((LUMA_R * r + LUMA_G * g + LUMA_B * b + 16384) >> 15) + 128];
+    uint32_t U = t->yuv[1][((YUV_U * (b - Y) + 16384) >> 15) + 256];
+    uint32_t V = t->yuv[2][((YUV_V * (r - Y) + 16384) >> 15) + 256];
+    return (pixel & 0xFF000000) | (Y << 16) | (U << 8) | V;
+}
+
+static inline uint32_t yiqLookup(uint32_t pixel, const ChannelTables *t) {
+    int32_t r = (pixel >> 16) & 0xFF, g = (pixel >> 8) & 0xFF, b = pixel & 0xFF;
+    uint32_t Y = t->yiq[0][((LUMA_R * r + LUMA_G * g + LUMA_B * b + 16384) >> 15) + 128];
+    uint32_t I = t->yiq[1][((YIQ_I_R * r + YIQ_I_G * g + YIQ_I_B * b + 16384) >> 15) + 256];
+    uint32_t Q = t->yiq[2][((YIQ_Q_R * r + YIQ_Q_G * g + YIQ_Q_B * b + 16384) >> 15) + 256];
+    return (pixel & 0xFF000000) | (Y << 16) | (I << 8) | Q;
+}
+
+uint32_t ARGBColor(uint32_t pixel) {
+    return argbLookup(pixel, channelTables());
+}
+
+uint32_t YUVColor(uint32_t pixel) {
+    return yuvLookup(pixel, channelTables());
+}
+
+uint32_t YIQColor(uint32_t pixel) {
+    return yiqLookup(pixel, channelTables());
+}
+
+uint32_t CMYColor(uint32_t pixel) {
+    return cmyLookup(pixel, channelTables());
+}
+
+uint32_t MonochromeColor(uint32_t pixel) {
+    uint8_t r = (pixel >> 16) & 0xFF;
+    uint8_t g = (pixel >> 8) & 0xFF;
+    uint8_t b = pixel & 0xFF;
+    uint8_t Y = (uint8_t)(0.299 * r + 0.587 * g + 0.114 * b);
+    return (Y > 128) ? 0xFFFFFFFF : 0xFF000000;
+}
+
+// DITHERING: Floyd-Steinberg error diffusion run as a row wavefront. Each row
+// is one task; it may process pixel x once the row above has finished x + 1,
+// so rows run staggered across the worker pool. Error rows live in a small
+// ring that is cleared as it is consumed, and the 7/16 term is carried
+// locally, so the result matches the serial order bit for bit. Every pixel
+// becomes a scale x scale block of the output, which may alias the source
+// when the scale is 1.
+#define DITHER_CHUNK 64
+
+typedef struct {
+    const uint32_t *pixels;
+    int sourceStride;
+    uint32_t *output;
+    int outputStride;
+    int scale;
+    int width;
+    int height;
+    float *errorRows;
+    int errorStride;
+    int ringRows;
+    SDL_atomic_t *progress;
+} DitherJob;
+
+void waitForDitherRow(SDL_atomic_t *progress, int needed) {
+    int spins = 0;
+    while (SDL_AtomicGet(progress) < needed) {
+        if (++spins == 256) {
+            SDL_Delay(0);
+            spins = 0;
+        }
+    }
+}
+
+void ditherRow(void *context, int y) {
+    DitherJob *job = (DitherJob *)context;
+    int width = job->width;
+    float *current = job->errorRows + (size_t)(y % job->ringRows) * job->errorStride;
+    float *next = job->errorRows + (size_t)((y + 1) % job->ringRows) * job->errorStride;
+    boolean hasNext = (y + 1 < job->height) ? TRUE : FALSE;
+    const uint32_t *source = job->pixels + (size_t)y * job->sourceStride;
+    uint32_t *top = job->output + (size_t)y * job->scale * job->outputStride;
+    uint32_t *bottom = top + job->outputStride;
+    float carry = 0.0f;
+    for (int x0 = 0; x0 < width; x0 += DITHER_CHUNK) {
+        int x1 = (x0 + DITHER_CHUNK < width) ? x0 + DITHER_CHUNK : width;
+        if (y > 0)
+            waitForDitherRow(&job->progress[y - 1], (x1 + 1 < width) ? x1 + 1 : width);
+        for (int x = x0; x < x1; x++) {
+            uint32_t pixel = source[x];
+            uint8_t r = (pixel >> 16) & 0xFF;
+            uint8_t g = (pixel >> 8) & 0xFF;
+            uint8_t b = pixel & 0xFF;
+            float gray = 0.299f * r + 0.587f * g + 0.114f * b + (current[x] + carry);
+            current[x] = 0.0f;
+            uint8_t quantized = (gray >= 128) ? 255 : 0;
+            float error = gray - quantized;
+            uint32_t outputColor = (quantized == 255) ? 0xFFFFFFFF : 0xFF000000;
+            if (job->scale == 2) {
+                top[x * 2] = outputColor;
+                top[x * 2 + 1] = outputColor;
+                bottom[x * 2] = outputColor;
+                bottom[x * 2 + 1] = outputColor;
+            } else {
+                top[x] = outputColor;
+            }
+            carry = (x + 1 < width) ? error * 7.0f / 16.0f : 0.0f;
+            if (hasNext) {
+                if (x > 0) next[x - 1] += error * 3.0f / 16.0f;
+                next[x] += error * 5.0f / 16.0f;
+                if (x + 1 < width) next[x + 1] += error * 1.0f / 16.0f;
+            }
+        }
+        SDL_AtomicSet(&job->progress[y], x1);
+    }
+}
+
+boolean ditherPixels(const uint32_t *pixels, int sourceStride, uint32_t *output, int outputStride, int width, int height, int scale) {
+    DitherJob job;
+    job.pixels = pixels;
+    job.sourceStride = sourceStride;
+    job.output = output;
+    job.outputStride = outputStride;
+    job.scale = scale;
+    job.width = width;
+    job.height = height;
+    job.errorStride = width + 1;
+    job.ringRows = workerCount() + 2;
+    job.errorRows = (float *)scratchCalloc((size_t)job.ringRows * job.errorStride, sizeof(float));
+    job.progress = (SDL_atomic_t *)scratchCalloc(height > 0 ? height : 1, sizeof(SDL_atomic_t));
+    if (!job.errorRows || !job.progress) {
+        printf("Memory allocation failed for dithering.");
+        scratchFree(job.errorRows);
+        scratchFree(job.progress);
+        return FALSE;
+    }
+    runParallelOrdered(ditherRow, &job, height);
+    scratchFree(job.errorRows);
+    scratchFree(job.progress);
+    return TRUE;
+}
+
+// The pooled buffer's real size goes to *capacity when it is not NULL.
+uint32_t *Dithered1BitColor(uint32_t *pixels, int width, int height, size_t *capacity) {
+    int newWidth = width * 2;
+    int newHeight = height * 2;
+    size_t ditheredBytes;
+    uint32_t *ditheredPixels = (uint32_t *)acquireBuffer((size_t)newWidth * newHeight * sizeof(uint32_t), &ditheredBytes);
+    if (!ditheredPixels) {
+        printf("Memory allocation failed for dithering.");
+        return NULL;
+    }
+    if (!ditherPixels(pixels, width, ditheredPixels, newWidth, width, height, 2)) {
+        releaseBuffer(ditheredPixels, ditheredBytes);
+        return NULL;
+    }
+    if (capacity)
+        *capacity = ditheredBytes;
+    return ditheredPixels;
+}
+
+// DITHER CACHE: the dithered image only depends on the source pixels, so it
+// is kept until a different image (or a reloaded asset) is displayed.
+typedef struct {
+    const uint32_t *source;
+    int width;
+    int height;
+    uint32_t generation;
+    image result;
+    size_t resultBytes;
+} DitherCache;
+
+static DitherCache ditherCache;
+
+void disposeDitherCache() {
+    if (ditherCache.result.pixelArray) {
+        forgetMipmaps(ditherCache.result.pixelArray);
+        forgetTransforms(ditherCache.result.pixelArray);
+    }
+    releaseBuffer(ditherCache.result.pixelArray, ditherCache.resultBytes);
+    memset(&ditherCache, 0, sizeof(ditherCache));
+}
+
+image ditheredImage(image source) {
+    if (ditherCache.result.pixelArray != NULL &&
+        ditherCache.source == source.pixelArray &&
+        ditherCache.width == source.width &&
+        ditherCache.height == source.height &&
+        ditherCache.generation == assetGeneration)
+        return ditherCache.result;
+    disposeDitherCache();
+    size_t capacity;
+    uint32_t *ditheredPixels = Dithered1BitColor(source.pixelArray, source.width, source.height, &capacity);
+    if (ditheredPixels == NULL)
+        return (image){0, 0, NULL};
+    ditherCache.source = source.pixelArray;
+    ditherCache.width = source.width;
+    ditherCache.height = source.height;
+    ditherCache.generation = assetGeneration;
+    ditherCache.result = (image){source.width * 2, source.height * 2, ditheredPixels};
+    ditherCache.resultBytes = capacity;
+    return ditherCache.result;
+}
+
+// ADAPTIVE PALETTE: eight-bit mode quantises to 256 colours chosen for the
+// displayed image by median cut over a 5-5-5 colour histogram. Every
+// histogram cell is then mapped to its nearest palette entry once, so a
+// pixel costs a single lookup in the 32x32x32 inverse colormap. The palette
+// is cached with the image like the dithered copy and rebuilt only when a
+// different image (or a reloaded asset) is shown.
+#define PALETTE_CELLS (1 << 15)
+#define PALETTE_SAMPLE_PIXELS (4 << 20)
+
+typedef struct {
+    uint32_t colors[256];
+    int colorCount;
+    uint8_t inverse[PALETTE_CELLS];
+} AdaptivePalette;
+
+typedef struct {
+    uint8_t low[3];
+    uint8_t high[3];
+    uint64_t population;
+} ColorBox;
+
+typedef struct {
+    boolean valid;
+    const void *source;
+    int width;
+    int height;
+    uint32_t generation;
+    AdaptivePalette palette;
+} PaletteCache;
+
+static PaletteCache paletteCache;
+static const AdaptivePalette *eightBitPalette = NULL;
+
+static inline int paletteCell(uint32_t pixel) {
+    return ((pixel >> 9) & 0x7C00) | ((pixel >> 6) & 0x03E0) | ((pixel >> 3) & 0x001F);
+}
+
+static inline int boxCell(int r, int g, int b) {
+    return (r << 10) | (g << 5) | b;
+}
+
+uint64_t boxPopulation(const ColorBox *box, const uint32_t *counts) {
+    uint64_t population = 0;
+    for (int r = box->low[0]; r <= box->high[0]; r++)
+        for (int g = box->low[1]; g <= box->high[1]; g++)
+            for (int b = box->low[2]; b <= box->high[2]; b++)
+                population += counts[boxCell(r, g, b)];
+    return population;
+}
+
+// Shrinks the box to the cells that are actually used, so the longest side
+// measures the spread of the colours rather than of the empty space.
+void shrinkBox(ColorBox *box, const uint32_t *counts) {
+    uint8_t low[3] = {31, 31, 31}, high[3] = {0, 0, 0};
+    for (int r = box->low[0]; r <= box->high[0]; r++)
+        for (int g = box->low[1]; g <= box->high[1]; g++)
+            for (int b = box->low[2]; b <= box->high[2]; b++) {
+                if (counts[boxCell(r, g, b)] == 0)
+                    continue;
+                int c[3] = {r, g, b};
+                for (int i = 0; i < 3; i++) {
+                    low[i] = (c[i] < low[i]) ? c[i] : low[i];
+                    high[i] = (c[i] > high[i]) ? c[i] : high[i];
+                }
+            }
+    memcpy(box->low, low, 3);
+    memcpy(box->high, high, 3);
+    box->population = boxPopulation(box, counts);
+}
+
+// Splits at the population median of the longest side; returns FALSE for
+// boxes of a single cell.
+boolean splitBox(ColorBox *box, ColorBox *second, const uint32_t *counts) {
+    int axis = 0;
+    for (int i = 1; i < 3; i++)
+        if (box->high[i] - box->low[i] > box->high[axis] - box->low[axis])
+            axis = i;
+    if (box->high[axis] == box->low[axis])
+        return FALSE;
+    uint64_t below = 0;
+    int cut = box->low[axis];
+    for (; cut < box->high[axis] - 1; cut++) {
+        ColorBox slice = *box;
+        slice.low[axis] = slice.high[axis] = (uint8_t)cut;
+        below += boxPopulation(&slice, counts);
+        if (below * 2 >= box->population)
+            break;
+    }
+    *second = *box;
+    box->high[axis] = (uint8_t)cut;
+    second->low[axis] = (uint8_t)(cut + 1);
+    shrinkBox(box, counts);
+    shrinkBox(second, counts);
+    return TRUE;
+}
+
+// Cells are searched in cubes of INVERSE_BLOCK cells a side. Only the
+// entries whose distance to the cube is below the smallest distance to its
+// farthest corner can be nearest to one of its cells, which leaves a
+// handful of candidates per cell.
+#define INVERSE_BLOCK 4
+
+typedef struct {
+    AdaptivePalette *palette;
+    int32_t components[256][3];
+} InverseJob;
+
+static inline int32_t colorDistance(const int32_t *color, int r, int g, int b) {
+    int32_t dr = r - color[0], dg = g - color[1], db = b - color[2];
+    return 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+}
+
+void inverseColormapBlock(InverseJob *job, int red, int green, int blue) {
+    static const int32_t weights[3] = {2, 4, 3};
+    int count = job->palette->colorCount;
+    int first[3] = {red, green, blue};
+    uint8_t candidates[256];
+    int32_t nearest[256];
+    int32_t bound = INT32_MAX;
+    for (int i = 0; i < count; i++) {
+        int32_t inside = 0, outside = 0;
+        for (int c = 0; c < 3; c++) {
+            int32_t low = (first[c] << 3) | 4, high = ((first[c] + INVERSE_BLOCK - 1) << 3) | 4;
+            int32_t value = job->components[i][c];
+            int32_t gap = (value < low) ? low - value : (value > high) ? value - high : 0;
+            int32_t reach = (value - low > high - value) ? value - low : high - value;
+            inside += weights[c] * gap * gap;
+            outside += weights[c] * reach * reach;
+        }
+        nearest[i] = inside;
+        bound = (outside < bound) ? outside : bound;
+    }
+    int candidateCount = 0;
+    for (int i = 0; i < count; i++)
+        if (nearest[i] <= bound)
+            candidates[candidateCount++] = (uint8_t)i;
+    for (int r = red; r < red + INVERSE_BLOCK; r++)
+        for (int g = green; g < green + INVERSE_BLOCK; g++)
+            for (int b = blue; b < blue + INVERSE_BLOCK; b++) {
+                int best = candidates[0];
+                int32_t bestDistance = colorDistance(job->components[best], (r << 3) | 4, (g << 3) | 4, (b << 3) | 4);
+                for (int i = 1; i < candidateCount; i++) {
+                    int32_t distance = colorDistance(job->components[candidates[i]], (r << 3) | 4, (g << 3) | 4, (b << 3) | 4);
+                    if (distance < bestDistance) {
+                        bestDistance = distance;
+                        best = candidates[i];
+                    }
+                }
+                job->palette->inverse[boxCell(r, g, b)] = (uint8_t)best;
+            }
+}
+
+void inverseColormapSlice(void *context, int slice) {
+    for (int green = 0; green < 32; green += INVERSE_BLOCK)
+        for (int blue = 0; blue < 32; blue += INVERSE_BLOCK)
+            inverseColormapBlock((InverseJob *)context, slice * INVERSE_BLOCK, green, blue);
+}
+
+void buildInverseColormap(AdaptivePalette *palette) {
+    InverseJob job;
+    job.palette = palette;
+    for (int i = 0; i < palette->colorCount; i++) {
+        job.components[i][0] = (palette->colors[i] >> 16) & 0xFF;
+        job.components[i][1] = (palette->colors[i] >> 8) & 0xFF;
+        job.components[i][2] = palette->colors[i] & 0xFF;
+    }
+    runParallel(inverseColormapSlice, &job, 32 / INVERSE_BLOCK);
+}
+
+// Builds the palette from at most PALETTE_SAMPLE_PIXELS evenly spaced rows.
+boolean buildPalette(image source, AdaptivePalette *palette) {
+    uint32_t *counts = (uint32_t *)scratchCalloc(PALETTE_CELLS, sizeof(uint32_t));
+    uint64_t *sums = (uint64_t *)scratchCalloc((size_t)PALETTE_CELLS * 3, sizeof(uint64_t));
+    if (counts == NULL || sums == NULL) {
+        printf("Memory allocation failed for the palette histogram!\n");
+        scratchFree(counts);
+        scratchFree(sums);
+        return FALSE;
+    }
+    int64_t pixels = (int64_t)source.width * source.height;
+    int rowStep = (int)((pixels + PALETTE_SAMPLE_PIXELS - 1) / PALETTE_SAMPLE_PIXELS);
+    for (int y = 0; y < source.height; y += (rowStep > 1) ? rowStep : 1) {
+        const uint32_t *row = source.pixelArray + (size_t)y * source.width;
+        for (int x = 0; x < source.width; x++) {
+            int cell = paletteCell(row[x]);
+            counts[cell]++;
+            sums[cell * 3] += (row[x] >> 16) & 0xFF;
+            sums[cell * 3 + 1] += (row[x] >> 8) & 0xFF;
+            sums[cell * 3 + 2] += row[x] & 0xFF;
+        }
+    }
+    ColorBox boxes[256];
+    boxes[0] = (ColorBox){{0, 0, 0}, {31, 31, 31}, 0};
+    shrinkBox(&boxes[0], counts);
+    int boxCount = 1;
+    while (boxCount < 256) {
+        int chosen = -1;
+        uint64_t bestScore = 0;
+        for (int i = 0; i < boxCount; i++) {
+            int side = 0;
+            for (int c = 0; c < 3; c++)
+                side = (boxes[i].high[c] - boxes[i].low[c] > side) ? boxes[i].high[c] - boxes[i].low[c] : side;
+            uint64_t score = boxes[i].population * (uint64_t)side;
+            if (score > bestScore) {
+                bestScore = score;
+                chosen = i;
+            }
+        }
+        if (chosen < 0 || !splitBox(&boxes[chosen], &boxes[boxCount], counts))
+            break;
+        boxCount++;
+    }
+    palette->colorCount = boxCount;
+    for (int i = 0; i < boxCount; i++) {
+        uint64_t total[3] = {0, 0, 0}, population = 0;
+        for (int r = boxes[i].low[0]; r <= boxes[i].high[0]; r++)
+            for (int g = boxes[i].low[1]; g <= boxes[i].high[1]; g++)
+                for (int b = boxes[i].low[2]; b <= boxes[i].high[2]; b++) {
+                    int cell = boxCell(r, g, b);
+                    population += counts[cell];
+                    for (int c = 0; c < 3; c++)
+                        total[c] += sums[cell * 3 + c];
+                }
+        uint32_t color = 0xFF000000;
+        for (int c = 0; c < 3; c++)
+            color |= (uint32_t)(population ? (total[c] + population / 2) / population : 0) << (16 - 8 * c);
+        palette->colors[i] = color;
+    }
+    for (int i = boxCount; i < 256; i++)
+        palette->colors[i] = palette->colors[boxCount - 1];
+    scratchFree(sums);
+    scratchFree(counts);
+    buildInverseColormap(palette);
+    return TRUE;
+}
+
+void mapToPalette(const AdaptivePalette *palette, const uint32_t *source, uint32_t *destination, int count) {
+    for (int x = 0; x < count; x++)
+        destination[x] = palette->colors[palette->inverse[paletteCell(source[x])]];
+}
+
+// Tiled images are sampled from the first pyramid level that fits the
+// sample budget.
+const AdaptivePalette *imagePalette(image source) {
+    const void *identity = source.tiles ? (const void *)source.tiles : (const void *)source.pixelArray;
+    if (identity == NULL)
+        return NULL;
+    if (paletteCache.valid && paletteCache.source == identity && paletteCache.width == source.width &&
+        paletteCache.height == source.height && paletteCache.generation == assetGeneration)
+        return &paletteCache.palette;
+    paletteCache.valid = FALSE;
+    image sample = source;
+    if (source.tiles) {
+        int level = 0;
+        while (level + 1 < TILE_LEVELS &&
+               (int64_t)tiledLevelExtent(source.width, level) * tiledLevelExtent(source.height, level) > PALETTE_SAMPLE_PIXELS)
+            level++;
+        sample = tiledLevelImage(source.tiles, level);
+        if (sample.pixelArray == NULL)
+            return NULL;
+    }
+    boolean built = buildPalette(sample, &paletteCache.palette);
+    if (source.tiles)
+        free(sample.pixelArray);
+    if (!built)
+        return NULL;
+    paletteCache.valid = TRUE;
+    paletteCache.source = identity;
+    paletteCache.width = source.width;
+    paletteCache.height = source.height;
+    paletteCache.generation = assetGeneration;
+    return &paletteCache.palette;
+}
+
+// EightBitRow has no image argument, so the interactive paths pick the
+// palette before drawing; without one it falls back to the fixed 3-3-2
+// palette.
+void selectEightBitPalette(image source) {
+    eightBitPalette = imagePalette(source);
+}
+
+uint32_t EightBitColor(uint32_t pixel) {
+    uint8_t r = (pixel >> 16) & 0xFF;
+    uint8_t g = (pixel >> 8) & 0xFF;
+    uint8_t b = pixel & 0xFF;
+    uint8_t index = ((r & 0xE0) >> 5) << 5 | ((g & 0xE0) >> 5) << 2 | ((b & 0xC0) >> 6);
+    return EightBitPalette[index];
+}
+
+void CopyRow(const uint32_t *source, uint32_t *destination, int count) {
+    if (source != destination)
+        memmove(destination, source, count * sizeof(uint32_t));
+}
+
+void ARGBRow(const uint32_t *source, uint32_t *destination, int count) {
+    const ChannelTables *t = channelTables();
+    for (int x = 0; x < count; x++)
+        destination[x] = argbLookup(source[x], t);
+}
+
+void YUVRow(const uint32_t *source, uint32_t *destination, int count) {
+    if (colorKernels()->vectorized) {
+        ComponentScales scales = componentScales(yScale, uScale, vScale);
+        colorKernels()->argbToYUV(source, destination, count, &scales);
+        return;
+    }
+    const ChannelTables *t = channelTables();
+    for (int x = 0; x < count; x++)
+        destination[x] = yuvLookup(source[x], t);
+}
+
+void YIQRow(const uint32_t *source, uint32_t *destination, int count) {
+    if (colorKernels()->vectorized) {
+        ComponentScales scales = componentScales(yiqYScale, iScale, qScale);
+        colorKernels()->argbToYIQ(source, destination, count, &scales);
+        return;
+    }
+    const ChannelTables *t = channelTables();
+    for (int x = 0; x < count; x++)
+        destination[x] = yiqLookup(source[x], t);
+}
+
+void CMYRow(const uint32_t *source, uint32_t *destination, int count) {
+    const ChannelTables *t = channelTables();
+    for (int x = 0; x < count; x++)
+        destination[x] = cmyLookup(source[x], t);
+}
+
+void MonochromeRow(const uint32_t *source, uint32_t *destination, int count) {
+    for (int x = 0; x < count; x++)
+        destination[x] = MonochromeColor(source[x]);
+}
+
+void EightBitRow(const uint32_t *source, uint32_t *destination, int count) {
+    if (eightBitPalette) {
+        mapToPalette(eightBitPalette, source, destination, count);
+        return;
+    }
+    for (int x = 0; x < count; x++)
+        destination[x] = EightBitColor(source[x]);
+}
+
+RowFunction rowFunctionForMode(DisplayMode mode) {
+    switch (mode) {
+    case DISPLAY_ARGB: return ARGBRow;
+    case DISPLAY_YUV: return YUVRow;
+    case DISPLAY_YIQ: return YIQRow;
+    case DISPLAY_CMY: return CMYRow;
+    case DISPLAY_MONOCHROME: return MonochromeRow;
+    case DISPLAY_8BIT: return EightBitRow;
+    default: return NULL;
+    }
+}
+
+// FILTER GRAPH: a chain of display modes applied to a whole image, such as
+// argb,cmy,8bit,dithered (scale, colour space, quantise, dither). Building
+// the graph composes adjacent per-channel stages (the ARGB scales and CMY)
+// into one lookup. The image is then processed in tiles of whole rows sized
+// for the L2 cache and spread over the worker pool; every stage runs over a
+// tile while it is still cached, so a chain reads the source and writes the
+// result once. Quantising needs a palette built from the pixels that reach
+// it, so the stages in front of it finish first, and dithering diffuses its
+// error over the whole image, so it has to be the last filter.
+#define FILTER_MAX_NODES 8
+#define FILTER_TILE_BYTES (256 << 10)
+
+typedef enum {
+    FILTER_ROWS,
+    FILTER_CHANNELS,
+    FILTER_QUANTISE
+} FilterKind;
+
+typedef struct {
+    FilterKind kind;
+    RowFunction rowFunction;
+    uint32_t tables[4][256];
+} FilterStage;
+
+typedef struct {
+    FilterStage stages[FILTER_MAX_NODES];
+    int stageCount;
+    boolean dither;
+    AdaptivePalette *palette;
+} FilterGraph;
+
+typedef struct {
+    const FilterGraph *graph;
+    const uint32_t *source;
+    uint32_t *destination;
+    int firstStage;
+    int lastStage;
+    size_t pixelCount;
+    size_t tilePixels;
+} FilterJob;
+
+void channelStageTables(DisplayMode mode, uint32_t tables[4][256]) {
+    const ChannelTables *t = channelTables();
+    for (int v = 0; v < 256; v++) {
+        if (mode == DISPLAY_ARGB) {
+            for (int channel = 0; channel < 4; channel++)
+                tables[channel][v] = t->argb[channel][v];
+        } else {
+            tables[0][v] = (uint32_t)v << 24;
+            for (int channel = 0; channel < 3; channel++)
+                tables[channel + 1][v] = t->cmy[channel][v];
+        }
+    }
+}
+
+void disposeFilterGraph(FilterGraph *graph) {
+    if (graph == NULL)
+        return;
+    free(graph->palette);
+    free(graph);
+}
+
+// Returns NULL for a chain that cannot be built. The scales are taken as
+// they are now.
+FilterGraph *createFilterGraph(const DisplayMode *modes, int modeCount) {
+    FilterGraph *graph = (FilterGraph *)countedCalloc(1, sizeof(FilterGraph));
+    if (graph == NULL) {
+        printf("Memory allocation failed for the filter graph!\n");
+        return NULL;
+    }
+    for (int i = 0; i < modeCount; i++) {
+        if (graph->dither) {
+            printf("Dithering has to be the last filter.\n");
+            disposeFilterGraph(graph);
+            return NULL;
+        }
+        if (modes[i] == DISPLAY_DITHERED) {
+            graph->dither = TRUE;
+            continue;
+        }
+        FilterStage *previous = graph->stageCount ? &graph->stages[graph->stageCount - 1] : NULL;
+        boolean perChannel = (modes[i] == DISPLAY_ARGB || modes[i] == DISPLAY_CMY) ? TRUE : FALSE;
+        if (perChannel && previous && previous->kind == FILTER_CHANNELS) {
+            uint32_t tables[4][256];
+            channelStageTables(modes[i], tables);
+            for (int channel = 0; channel < 4; channel++) {
+                int shift = 24 - channel * 8;
+                for (int v = 0; v < 256; v++)
+                    previous->tables[channel][v] = tables[channel][(previous->tables[channel][v] >> shift) & 0xFF];
+            }
+            continue;
+        }
+        if (graph->stageCount == FILTER_MAX_NODES) {
+            printf("A filter graph holds at most %d filters.\n", FILTER_MAX_NODES);
+            disposeFilterGraph(graph);
+            return NULL;
+        }
+        FilterStage *stage = &graph->stages[graph->stageCount++];
+        if (perChannel) {
+            stage->kind = FILTER_CHANNELS;
+            channelStageTables(modes[i], stage->tables);
+        } else if (modes[i] == DISPLAY_8BIT) {
+            stage->kind = FILTER_QUANTISE;
+        } else {
+            stage->kind = FILTER_ROWS;
+            stage->rowFunction = rowFunctionForMode(modes[i]);
+        }
+    }
+    return graph;
+}
+
+void runFilterStage(const FilterGraph *graph, const FilterStage *stage, const uint32_t *source, uint32_t *destination, size_t count) {
+    switch (stage->kind) {
+    case FILTER_CHANNELS:
+        for (size_t x = 0; x < count; x++) {
+            uint32_t pixel = source[x];
+            destination[x] = stage->tables[0][pixel >> 24] | stage->tables[1][(pixel >> 16) & 0xFF] |
+                             stage->tables[2][(pixel >> 8) & 0xFF] | stage->tables[3][pixel & 0xFF];
+        }
+        break;
+    case FILTER_QUANTISE:
+        mapToPalette(graph->palette, source, destination, (int)count);
+        break;
+    case FILTER_ROWS:
+        stage->rowFunction(source, destination, (int)count);
+        break;
+    }
+}
+
+void filterTile(void *context, int tile) {
+    FilterJob *job = (FilterJob *)context;
+    size_t first = (size_t)tile * job->tilePixels;
+    size_t count = (first + job->tilePixels < job->pixelCount) ? job->tilePixels : job->pixelCount - first;
+    const uint32_t *source = job->source + first;
+    uint32_t *destination = job->destination + first;
+    for (int i = job->firstStage; i < job->lastStage; i++) {
+        runFilterStage(job->graph, &job->graph->stages[i], source, destination, count);
+        source = destination;
+    }
+}
+
+// Runs the stages (not the dither) from the source into a destination of
+// the same size, which may be the source itself.
+boolean applyFilterStages(FilterGraph *graph, image source, uint32_t *destination) {
+    size_t pixelCount = (size_t)source.width * source.height;
+    if (graph->stageCount == 0 && destination != source.pixelArray)
+        memcpy(destination, source.pixelArray, pixelCount * sizeof(uint32_t));
+    int tileRows = FILTER_TILE_BYTES / (source.width * (int)sizeof(uint32_t));
+    FilterJob job = {graph, source.pixelArray, destination, 0, 0, pixelCount, (size_t)(tileRows > 1 ? tileRows : 1) * source.width};
+    prepareColorTables();
+    while (job.firstStage < graph->stageCount) {
+        job.lastStage = job.firstStage + 1;
+        while (job.lastStage < graph->stageCount && graph->stages[job.lastStage].kind != FILTER_QUANTISE)
+            job.lastStage++;
+        if (graph->stages[job.firstStage].kind == FILTER_QUANTISE) {
+            if (graph->palette == NULL)
+                graph->palette = (AdaptivePalette *)countedMalloc(sizeof(AdaptivePalette));
+            if (graph->palette == NULL || !buildPalette((image){source.width, source.height, (uint32_t *)job.source}, graph->palette))
+                return FALSE;
+        }
+        runParallel(filterTile, &job, (int)((pixelCount + job.tilePixels - 1) / job.tilePixels));
+        job.source = destination;
+        job.firstStage = job.lastStage;
+    }
+    return TRUE;
+}
+
+image runFilterGraph(FilterGraph *graph, image source) {
+    if (graph->stageCount == 0 && graph->dither) {
+        uint32_t *ditheredPixels = Dithered1BitColor(source.pixelArray, source.width, source.height, NULL);
+        return ditheredPixels ? (image){source.width * 2, source.height * 2, ditheredPixels} : (image){0, 0, NULL};
+    }
+    uint32_t *pixelArray = (uint32_t *)countedMalloc((size_t)source.width * source.height * sizeof(uint32_t));
+    if (pixelArray == NULL) {
+        printf("Memory allocation failed for the filtered image!\n");
+        return (image){0, 0, NULL};
+    }
+    if (!applyFilterStages(graph, source, pixelArray)) {
+        free(pixelArray);
+        return (image){0, 0, NULL};
+    }
+    if (!graph->dither)
+        return (image){source.width, source.height, pixelArray};
+    uint32_t *ditheredPixels = Dithered1BitColor(pixelArray, source.width, source.height, NULL);
+    free(pixelArray);
+    return ditheredPixels ? (image){source.width * 2, source.height * 2, ditheredPixels} : (image){0, 0, NULL};
+}
+
+// Tiled sources are decoded at full resolution first.
+image filterImage(image source, const DisplayMode *modes, int modeCount) {
+    if (source.tiles) {
+        image decoded = tiledLevelImage(source.tiles, 0);
+        if (decoded.pixelArray == NULL)
+            return decoded;
+        image filtered = filterImage(decoded, modes, modeCount);
+        free(decoded.pixelArray);
+        return filtered;
+    }
+    FilterGraph *graph = createFilterGraph(modes, modeCount);
+    if (graph == NULL)
+        return (image){0, 0, NULL};
+    image filtered = runFilterGraph(graph, source);
+    disposeFilterGraph(graph);
+    return filtered;
+}
+
+// Batch conversions run in parallel, so each builds its own graph and
+// palette instead of going through the shared caches.
+image transformImage(image source, DisplayMode mode) {
+    return filterImage(source, &mode, 1);
+}
+
+void displayImageInARGB(API *_API, image _image, Point point) {
+    applyImageMovement(_API->pixels, _image, point, ARGBRow);
+}
+
+void displayImageInYUV(API *_API, image _image, Point point) {
+    applyImageMovement(_API->pixels, _image, point, YUVRow);
+}
+
+void displayImageInYIQ(API *_API, image _image, Point point) {
+    applyImageMovement(_API->pixels, _image, point, YIQRow);
+}
+
+void displayImageInCMY(API *_API, image _image, Point point) {
+    applyImageMovement(_API->pixels, _image, point, CMYRow);
+}
+
+void displayImageInMonochrome(API *_API, image _image, Point point) {
+    applyImageMovement(_API->pixels, _image, point, MonochromeRow);
+}
+
+void displayImageInDithered1Bit(API *_API, image _image, Point point) {
+    // A tiled image is never dithered as a whole: the visible part is drawn
+    // at the dithered image's scale and the error is diffused on screen.
+    if (_image.tiles) {
+        SDL_Rect area = blitImage(_API->pixels, _image, point, imageZoom * 2.0f, CopyRow);
+        uint32_t *origin = _API->pixels + area.y * SCREEN_WIDTH + area.x;
+        if (SDL_RectEmpty(&area) || !ditherPixels(origin, SCREEN_WIDTH, origin, SCREEN_WIDTH, area.w, area.h, 1))
+            return;
+        for (int y = 0; y < area.h; y++)
+            ARGBRow(origin + y * SCREEN_WIDTH, origin + y * SCREEN_WIDTH, area.w);
+        return;
+    }
+    image dithered = ditheredImage(_image);
+    if (dithered.pixelArray)
+        applyImageMovement(_API->pixels, dithered, point, ARGBRow);
+}
+
+void displayImageIn8Bit(API *_API, image _image, Point point) {
+    selectEightBitPalette(_image);
+    applyImageMovement(_API->pixels, _image, point, EightBitRow);
+}
+
+void displayImage(API *_API, image _image, Point point) {
+    switch (currentDisplay) {
+    case DISPLAY_ARGB:
+        displayImageInARGB(_API, _image, point);
+        break;
+    case DISPLAY_YUV:
+        displayImageInYUV(_API, _image, point);
+        break;
+    case DISPLAY_YIQ:
+        displayImageInYIQ(_API, _image, point);
+        break;
+    case DISPLAY_CMY:
+        displayImageInCMY(_API, _image, point);
+        break;
+    case DISPLAY_MONOCHROME:
+        displayImageInMonochrome(_API, _image, point);
+        break;
+    case DISPLAY_DITHERED:
+        displayImageInDithered1Bit(_API, _image, point);
+        break;
+    case DISPLAY_8BIT:
+        displayImageIn8Bit(_API, _image, point);
+        break;
+    }
+}
+
+// HISTOGRAMS: bins what is actually displayed. Every row goes through the
+// mode's row function (or comes from the cached dithered image) and feeds
+// the three displayed channels and Rec. 601 luma at once. Bands of rows run
+// on the worker pool with private bins that are merged at the end, and the
+// result is kept until the image, the mode or a scale changes.
+#define HISTOGRAM_BAND_ROWS 32
+#define HISTOGRAM_TILED_PIXELS (4 << 20)
+#define HISTOGRAM_TILED_WIDTH 16384
+
+typedef struct {
+    int channel[3][256];
+    int luma[256];
+} Histograms;
+
+typedef struct {
+    image source;
+    RowFunction rowFunction;
+    Histograms *result;
+    SDL_SpinLock lock;
+} HistogramJob;
+
+typedef struct {
+    boolean valid;
+    const void *source;
+    int width;
+    int height;
+    DisplayMode mode;
+    uint32_t parameters;
+    uint32_t assets;
+    Histograms result;
+} HistogramCache;
+
+static HistogramCache histogramCache;
+
+void histogramBand(void *context, int band) {
+    HistogramJob *job = (HistogramJob *)context;
+    int width = job->source.width;
+    int firstRow = band * HISTOGRAM_BAND_ROWS;
+    int lastRow = (firstRow + HISTOGRAM_BAND_ROWS < job->source.height) ? firstRow + HISTOGRAM_BAND_ROWS : job->source.height;
+    uint32_t *row = (uint32_t *)scratchAlloc((size_t)width * sizeof(uint32_t));
+    if (row == NULL) {
+        printf("Memory allocation failed for the histogram row!\n");
+        return;
+    }
+    Histograms bins;
+    memset(&bins, 0, sizeof(bins));
+    for (int y = firstRow; y < lastRow; y++) {
+        job->rowFunction(job->source.pixelArray + (size_t)y * width, row, width);
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = row[x];
+            uint8_t r = (pixel >> 16) & 0xFF;
+            uint8_t g = (pixel >> 8) & 0xFF;
+            uint8_t b = pixel & 0xFF;
+            bins.channel[0][r]++;
+            bins.channel[1][g]++;
+            bins.channel[2][b]++;
+            bins.luma[(LUMA_R * r + LUMA_G * g + LUMA_B * b + (1 << 14)) >> 15]++;
+        }
+    }
+    scratchFree(row);
+    SDL_AtomicLock(&job->lock);
+    for (int i = 0; i < 256; i++) {
+        job->result->channel[0][i] += bins.channel[0][i];
+        job->result->channel[1][i] += bins.channel[1][i];
+        job->result->channel[2][i] += bins.channel[2][i];
+        job->result->luma[i] += bins.luma[i];
+    }
+    SDL_AtomicUnlock(&job->lock);
+}
+
+// Tiled images are binned from the first level with at most
+// HISTOGRAM_TILED_PIXELS pixels, which keeps the shape of the distribution
+// without decoding the whole file.
+int histogramLevel(image img) {
+    int level = 0;
+    while (level + 1 < TILE_LEVELS &&
+           ((int64_t)tiledLevelExtent(img.width, level) * tiledLevelExtent(img.height, level) > HISTOGRAM_TILED_PIXELS ||
+            tiledLevelExtent(img.width, level) > HISTOGRAM_TILED_WIDTH))
+        level++;
+    return level;
+}
+
+const Histograms *displayHistograms(image img, DisplayMode mode) {
+    HistogramCache *cache = &histogramCache;
+    const void *identity = img.tiles ? (const void *)img.tiles : (const void *)img.pixelArray;
+    if (cache->valid && cache->source == identity && cache->width == img.width && cache->height == img.height &&
+        cache->mode == mode && cache->parameters == parameterVersion && cache->assets == assetGeneration)
+        return &cache->result;
+    memset(&cache->result, 0, sizeof(Histograms));
+    cache->valid = TRUE;
+    cache->source = identity;
+    cache->width = img.width;
+    cache->height = img.height;
+    cache->mode = mode;
+    cache->parameters = parameterVersion;
+    cache->assets = assetGeneration;
+    if (identity == NULL)
+        return &cache->result;
+    HistogramJob job;
+    image sample = {0, 0, NULL};
+    if (img.tiles) {
+        sample = tiledLevelImage(img.tiles, histogramLevel(img));
+        if (sample.pixelArray && mode == DISPLAY_DITHERED &&
+            !ditherPixels(sample.pixelArray, sample.width, sample.pixelArray, sample.width, sample.width, sample.height, 1)) {
+            free(sample.pixelArray);
+            sample.pixelArray = NULL;
+        }
+        job.source = sample;
+    } else {
+        job.source = (mode == DISPLAY_DITHERED) ? ditheredImage(img) : img;
+    }
+    if (mode == DISPLAY_8BIT)
+        selectEightBitPalette(img);
+    job.rowFunction = (mode == DISPLAY_DITHERED) ? ARGBRow : rowFunctionForMode(mode);
+    job.result = &cache->result;
+    job.lock = 0;
+    if (job.source.pixelArray == NULL)
+        return &cache->result;
+    prepareColorTables();
+    runParallel(histogramBand, &job, (job.source.height + HISTOGRAM_BAND_ROWS - 1) / HISTOGRAM_BAND_ROWS);
+    free(sample.pixelArray);
+    return &cache->result;
+}
+
+// The panel graphs the Y component in the YUV and YIQ modes and the luma of
+// the displayed colours everywhere else.
+const int *histogramForMode(const Histograms *histograms, DisplayMode mode) {
+    if (mode == DISPLAY_YUV || mode == DISPLAY_YIQ)
+        return histograms->channel[0];
+    return histograms->luma;
+}
+
+// GLYPH ATLAS: the alphabet and number sheets are scanned once per loaded
+// image into run-length spans of ink (anything that is not near-white) and
+// an advance width per glyph. Laid out strings are cached as clipped screen
+// spans, so drawing a label that was drawn before is a series of span fills.
+#define TEXT_LAYOUT_SLOTS 64
+
+typedef struct {
+    uint8_t y;
+    uint8_t x;
+    uint8_t length;
+} GlyphSpan;
+
+typedef struct {
+    int firstSpan;
+    int spanCount;
+    int advance;
+} Glyph;
+
+typedef struct {
+    const uint32_t *sheet;
+    int sheetWidth;
+    int sheetHeight;
+    uint32_t generation;
+    uint32_t version;
+    char firstCharacter;
+    int glyphCount;
+    int spaceWidth;
+    Glyph glyphs[26];
+    GlyphSpan *spans;
+    int spanCount;
+} GlyphAtlas;
+
+typedef struct {
+    int offset;
+    int length;
+} ScreenSpan;
+
+typedef struct {
+    const GlyphAtlas *atlas;
+    uint32_t version;
+    Point start;
+    char *text;
+    ScreenSpan *spans;
+    int spanCount;
+    Uint32 lastUsed;
+} TextLayout;
+
+static GlyphAtlas alphabetAtlas = {NULL, 0, 0, 0, 0, 'a', 26};
+static GlyphAtlas numberAtlas = {NULL, 0, 0, 0, 0, '0', 10};
+static TextLayout textLayouts[TEXT_LAYOUT_SLOTS];
+static Uint32 textLayoutClock = 0;
+
+boolean isInk(uint32_t pixel) {
+    uint8_t r = (pixel >> 16) & 0xFF;
+    uint8_t g = (pixel >> 8) & 0xFF;
+    uint8_t b = pixel & 0xFF;
+    return (r > 200 && g > 200 && b > 200) ? FALSE : TRUE;
+}
+
+const GlyphAtlas *glyphAtlas(GlyphAtlas *atlas, image sheet) {
+    if (atlas->sheet == sheet.pixelArray && atlas->sheetWidth == sheet.width && atlas->sheetHeight == sheet.height &&
+        atlas->generation == assetGeneration)
+        return atlas;
+    free(atlas->spans);
+    atlas->spans = NULL;
+    atlas->spanCount = 0;
+    atlas->sheet = sheet.pixelArray;
+    atlas->sheetWidth = sheet.width;
+    atlas->sheetHeight = sheet.height;
+    atlas->generation = assetGeneration;
+    atlas->version++;
+    int charWidth = sheet.width / atlas->glyphCount;
+    int charHeight = (sheet.height < 256) ? sheet.height : 255;
+    atlas->spaceWidth = charWidth * 1.25;
+    int capacity = 0;
+    for (int index = 0; index < atlas->glyphCount; index++) {
+        Glyph *glyph = &atlas->glyphs[index];
+        int rightMostPixel = 0;
+        glyph->firstSpan = atlas->spanCount;
+        for (int y = 0; y < charHeight; y++) {
+            const uint32_t *row = sheet.pixelArray + (size_t)y * sheet.width + index * charWidth;
+            for (int x = 0; x < charWidth && x < 256;) {
+                if (!isInk(row[x])) {
+                    x++;
+                    continue;
+                }
+                int runStart = x;
+                while (x < charWidth && x < 256 && isInk(row[x]))
+                    x++;
+                if (atlas->spanCount == capacity) {
+                    capacity = capacity ? capacity * 2 : 256;
+                    atlas->spans = (GlyphSpan *)countedRealloc(atlas->spans, capacity * sizeof(GlyphSpan));
+                }
+                atlas->spans[atlas->spanCount++] = (GlyphSpan){(uint8_t)y, (uint8_t)runStart, (uint8_t)(x - runStart)};
+                if (x - 1 > rightMostPixel)
+                    rightMostPixel = x - 1;
+            }
+        }
+        glyph->spanCount = atlas->spanCount - glyph->firstSpan;
+        glyph->advance = rightMostPixel + 2;
+    }
+    return atlas;
+}
+
+void freeTextLayout(TextLayout *layout) {
+    free(layout->text);
+    free(layout->spans);
+    memset(layout, 0, sizeof(TextLayout));
+}
+
+void disposeGlyphAtlases() {
+    for (int i = 0; i < TEXT_LAYOUT_SLOTS; i++)
+        freeTextLayout(&textLayouts[i]);
+    free(alphabetAtlas.spans);
+    free(numberAtlas.spans);
+    alphabetAtlas.spans = NULL;
+    numberAtlas.spans = NULL;
+    alphabetAtlas.sheet = NULL;
+    numberAtlas.sheet = NULL;
+}
+
+void appendScreenSpan(TextLayout *layout, int *capacity, int offset, int length) {
+    if (layout->spanCount == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        layout->spans = (ScreenSpan *)countedRealloc(layout->spans, *capacity * sizeof(ScreenSpan));
+    }
+    layout->spans[layout->spanCount++] = (ScreenSpan){offset, length};
+}
+
+const TextLayout *layoutText(const GlyphAtlas *atlas, Point start, const char *text) {
+    TextLayout *layout = NULL;
+    for (int i = 0; i < TEXT_LAYOUT_SLOTS; i++) {
+        TextLayout *candidate = &textLayouts[i];
+        if (candidate->text && candidate->atlas == atlas && candidate->version == atlas->version &&
+            candidate->start.x == start.x && candidate->start.y == start.y && strcmp(candidate->text, text) == 0) {
+            candidate->lastUsed = ++textLayoutClock;
+            return candidate;
+        }
+        if (layout == NULL || candidate->lastUsed < layout->lastUsed)
+            layout = candidate;
+    }
+    freeTextLayout(layout);
+    layout->atlas = atlas;
+    layout->version = atlas->version;
+    layout->start = start;
+    layout->text = strdup(text);
+    layout->lastUsed = ++textLayoutClock;
+    int capacity = 0;
+    int positionX = start.x;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c == ' ') {
+            positionX += atlas->spaceWidth;
+            continue;
+        }
+        int index = *c - atlas->firstCharacter;
+        if (index < 0 || index >= atlas->glyphCount)
+            continue;
+        const Glyph *glyph = &atlas->glyphs[index];
+        for (int i = 0; i < glyph->spanCount; i++) {
+            GlyphSpan span = atlas->spans[glyph->firstSpan + i];
+            int screenY = start.y + span.y;
+            int screenX = positionX + span.x;
+            int length = span.length;
+            if (screenY >= SCREEN_HEIGHT || screenX >= SCREEN_WIDTH)
+                continue;
+            if (screenX + length > SCREEN_WIDTH)
+                length = SCREEN_WIDTH - screenX;
+            appendScreenSpan(layout, &capacity, screenY * SCREEN_WIDTH + screenX, length);
+        }
+        positionX += glyph->advance;
+    }
+    return layout;
+}
+
+void drawTextLayout(API *_API, const TextLayout *layout) {
+    for (int i = 0; i < layout->spanCount; i++) {
+        uint32_t *destination = _API->pixels + layout->spans[i].offset;
+        for (int x = 0; x < layout->spans[i].length; x++)
+            destination[x] = 0xFF000000;
+    }
+}
+
+void drawNumber(API *_API, image numbers, Point start, const char *text) {
+    if (numbers.pixelArray == NULL) {
+        printf("Number image not loaded.\n");
+        return;
+    }
+    drawTextLayout(_API, layoutText(glyphAtlas(&numberAtlas, numbers), start, text));
+}
+
+void drawText(API *_API, image alphabet, Point start, const char *text) {
+    if (alphabet.pixelArray == NULL) {
+        printf("Alphabet image not loaded.\n");
+        return;
+    }
+    drawTextLayout(_API, layoutText(glyphAtlas(&alphabetAtlas, alphabet), start, text));
+}
+
+void drawHistogram(API *_API, const int histogram[256], image numbers) {
+    int histX = 40;
+    int histY = 80;
+    int histWidth = SCREEN_WIDTH - 60;
+    int histHeight = 160;
+    int maxFrequency = 1;
+    for (int i = 0; i < 256; i++) {
+        if (histogram[i] > maxFrequency)
+            maxFrequency = histogram[i];
+    }
+    fillRect(_API->pixels, (SDL_Rect){0, histY - 30, SCREEN_WIDTH, histHeight + 70}, 0xFFFFFFFF);
+    for (int i = 0; i <= 255; i += 32) {
+        int gridX = histX + (i * histWidth / 256);
+        for (int y = histY; y < histY + histHeight; y++) {
+            _API->pixels[y * SCREEN_WIDTH + gridX] = 0xFFAAAAAA; 
+        }
+    }
+    for (int i = 0; i <= 4; i++) {
+        int gridY = histY + histHeight - (i * histHeight / 4);
+        for (int x = histX; x < histX + histWidth; x++) {
+            _API->pixels[gridY * SCREEN_WIDTH + x] = 0xFFAAAAAA;
+        }
+    }
+    int barWidth = (histWidth / 256) - 1;
+    for (int i = 0; i < 256; i++) {
+        int barHeight = (histogram[i] * histHeight) / maxFrequency;
+        for (int y = histY + histHeight - barHeight; y < histY + histHeight - 1; y++) {
+            for (int x = histX + i * (barWidth + 1); x < histX + i * (barWidth + 1) + barWidth; x++) {
+                _API->pixels[y * SCREEN_WIDTH + x] = 0xFFFF0000;
+            }
+        }
+    }
+    for (int i = 0; i <= 255; i += 64) {
+        char label[4];
+        sprintf(label, "%d", i);  
+        int xPos = histX + (i * histWidth / 256) - 10;
+        int yPos = histY + histHeight + 12; 
+        Point textPos = {xPos, yPos};
+        drawNumber(_API, numbers, textPos, label);
+    }
+    for (int i = 0; i <= 4; i++) {
+        char label[5];
+        int value = (maxFrequency * i) / 4;  
+        sprintf(label, "%d", value);  
+        int xPos = histX - 25;
+        int yPos = histY + histHeight - (i * histHeight / 4) - 5;
+        Point textPos = {xPos, yPos};
+        drawNumber(_API, numbers, textPos, label);
+    }
+}
+    
+void drawCheckbox(API *_API, Checkbox checkbox) {
+    uint32_t boxColor = checkbox.checked ? 0xFF00AA00 : 0xFFFFFFFF;
+    uint32_t shadowColor = 0xFF404040;
+    int boxSize = 16;
+    for (int y = 2; y < boxSize + 2; y++) {
+        for (int x = 2; x < boxSize + 2; x++) {
+            uint32_t screenX = checkbox.position.x + x;
+            uint32_t screenY = checkbox.position.y + y;
+            if (screenX < SCREEN_WIDTH && screenY < SCREEN_HEIGHT) {
+                _API->pixels[screenY * SCREEN_WIDTH + screenX] = shadowColor;
+            }
+        }
+    }
+    for (int y = 0; y < boxSize; y++) {
+        for (int x = 0; x < boxSize; x++) {
+            uint32_t screenX = checkbox.position.x + x;
+            uint32_t screenY = checkbox.position.y + y;
+            if ((x == 0 && y == 0) || (x == 0 && y == boxSize - 1) || (x == boxSize - 1 && y == 0) || (x == boxSize - 1 && y == boxSize - 1))
+                continue; 
+            if (screenX < SCREEN_WIDTH && screenY < SCREEN_HEIGHT) {
+                _API->pixels[screenY * SCREEN_WIDTH + screenX] = boxColor;
+            }
+        }
+    }
+    if (checkbox.checked) {
+        for (int i = 3; i < boxSize - 4; i++) {
+            _API->pixels[(checkbox.position.y + i) * SCREEN_WIDTH + (checkbox.position.x + i)] = 0xFF000000;
+            _API->pixels[(checkbox.position.y + i) * SCREEN_WIDTH + (checkbox.position.x + boxSize - i - 1)] = 0xFF000000;
+        }
+    }
+}
+
+void drawButton(API *_API, Button button) {
+    uint32_t boxColor = 0xFFDDDDDD;    
     uint32_t borderColor = 0xFFAAAAAA; 
     uint32_t symbolColor = 0xFF000000; 
     uint32_t shadowColor = 0xFF505050;
@@ -782,130 +4202,1467 @@ void drawButton(API *_API, Button button) {
             }
         }
     }
-    int centerX = button.position.x + boxSize / 2;
-    int centerY = button.position.y + boxSize / 2;
-    if (button.type == '+') {
-        for (int i = -4; i <= 4; i++) {
-            _API->pixels[(centerY + i) * SCREEN_WIDTH + centerX] = symbolColor;
-            _API->pixels[centerY * SCREEN_WIDTH + (centerX + i)] = symbolColor;
+    int centerX = button.position.x + boxSize / 2;
+    int centerY = button.position.y + boxSize / 2;
+    if (button.type == '+') {
+        for (int i = -4; i <= 4; i++) {
+            _API->pixels[(centerY + i) * SCREEN_WIDTH + centerX] = symbolColor;
+            _API->pixels[centerY * SCREEN_WIDTH + (centerX + i)] = symbolColor;
+        }
+    } else if (button.type == '-') {
+        for (int i = -4; i <= 4; i++) {
+            _API->pixels[centerY * SCREEN_WIDTH + (centerX + i)] = symbolColor;
+        }
+    }
+}
+
+void drawWidget(API *_API, image alphabet, const Widget *widget) {
+    switch (widget->type) {
+    case WIDGET_PANEL:
+        fillRect(_API->pixels, widget->bounds, 0xFF505050);
+        break;
+    case WIDGET_TITLE:
+    case WIDGET_LABEL:
+        drawText(_API, alphabet, widget->position, widget->text);
+        break;
+    case WIDGET_MODE: {
+        boolean checked = (widget->value == (int)currentDisplay) ? TRUE : FALSE;
+        SDL_Rect bar = {widget->bounds.x, widget->bounds.y, widget->bounds.w, 18};
+        fillRect(_API->pixels, bar, checked ? 0xFF77AAFF : 0xFF606060);
+        drawCheckbox(_API, (Checkbox){widget->position, checked});
+        Point textPosition = {widget->position.x + 25, widget->bounds.y + UI_TEXT_OFFSET_Y};
+        drawText(_API, alphabet, textPosition, widget->text);
+        break;
+    }
+    case WIDGET_BUTTON:
+        drawButton(_API, (Button){widget->position, widget->symbol});
+        break;
+    }
+}
+
+// Draws the damaged widgets, or every widget when the panel background is
+// damaged. A widget repainted on its own first clears its bounds.
+void drawUI(API *_API, image alphabet) {
+    const UILayout *layout = uiLayout();
+    boolean everything = layout->widgets[0].damaged;
+    for (int i = 0; i < layout->widgetCount; i++) {
+        Widget *widget = &layout->widgets[i];
+        if (!everything && !widget->damaged)
+            continue;
+        if (!everything && widget->type != WIDGET_PANEL)
+            fillRect(_API->pixels, widget->bounds, 0xFF505050);
+        drawWidget(_API, alphabet, widget);
+        widget->damaged = FALSE;
+    }
+    ui.damagedCount = 0;
+}
+
+// The profiler overlay sits in the bottom left corner of the image pane and
+// shows the previous frame, one stage per line, in microseconds together
+// with the number of allocations made during the stage, followed by the
+// scratch memory taken from the frame arena and the buffers reused from the
+// pool.
+SDL_Rect profilerOverlayRect() {
+    int height = (STAGE_COUNT + 4) * 16 + 8;
+    return (SDL_Rect){10, SCREEN_HEIGHT - height - 10, 236, height};
+}
+
+void drawProfilerOverlay(API *_API, image alphabet, image numbers) {
+    SDL_Rect area = profilerOverlayRect();
+    fillRect(_API->pixels, area, 0xFFFFFFFF);
+    if (alphabet.pixelArray == NULL || numbers.pixelArray == NULL)
+        return;
+    char value[16];
+    int y = area.y + 6;
+    drawText(_API, alphabet, (Point){area.x + 6, y}, "fps");
+    sprintf(value, "%d", framesPerSecond());
+    drawNumber(_API, numbers, (Point){area.x + 112, y}, value);
+    y += 16;
+    drawText(_API, alphabet, (Point){area.x + 112, y}, "us");
+    drawText(_API, alphabet, (Point){area.x + 172, y}, "allocs");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        y += 16;
+        drawText(_API, alphabet, (Point){area.x + 6, y}, stageNames[stage]);
+        sprintf(value, "%d", (int)stageMicroseconds(profiler.shownDuration[stage]));
+        drawNumber(_API, numbers, (Point){area.x + 112, y}, value);
+        sprintf(value, "%d", profiler.shownAllocations[stage]);
+        drawNumber(_API, numbers, (Point){area.x + 172, y}, value);
+    }
+    y += 16;
+    drawText(_API, alphabet, (Point){area.x + 6, y}, "arena kb");
+    sprintf(value, "%d", frameMemory.arenaKilobytes);
+    drawNumber(_API, numbers, (Point){area.x + 112, y}, value);
+    sprintf(value, "%d", frameMemory.arenaAllocations);
+    drawNumber(_API, numbers, (Point){area.x + 172, y}, value);
+    y += 16;
+    drawText(_API, alphabet, (Point){area.x + 6, y}, "pool kb");
+    sprintf(value, "%d", frameMemory.poolKilobytes);
+    drawNumber(_API, numbers, (Point){area.x + 112, y}, value);
+    sprintf(value, "%d", frameMemory.poolReuses);
+    drawNumber(_API, numbers, (Point){area.x + 172, y}, value);
+}
+
+// Drawn over the bottom of the image pane while an image loads in the
+// background.
+void drawLoadProgress(API *_API, int percent, image alphabet, image numbers) {
+    SDL_Rect area = {10, SCREEN_HEIGHT - 40, SCREEN_WIDTH / 2 - 20, 26};
+    fillRect(_API->pixels, area, 0xFFFFFFFF);
+    fillRect(_API->pixels, (SDL_Rect){area.x + 2, area.y + 2, (area.w - 4) * percent / 100, area.h - 4}, COLOR_WIDGE);
+    if (alphabet.pixelArray == NULL || numbers.pixelArray == NULL)
+        return;
+    char value[16];
+    sprintf(value, "%d", percent);
+    drawText(_API, alphabet, (Point){area.x + 8, area.y + 6}, "loading");
+    drawNumber(_API, numbers, (Point){area.x + 96, area.y + 6}, value);
+}
+
+// PLANAR YUV: BT.601 limited-range Y'CbCr in the planar layouts encoders
+// read directly. Chroma is computed at full resolution for the one or two
+// source rows behind a chroma row, summed vertically and then downsampled
+// horizontally by a box or a [1 2 1] tent centred on the even column (the
+// MPEG-2/H.264 siting). The downsampler has SSE2 and AVX2 versions that
+// give the same bytes as the scalar one.
+#define PLANAR_BAND_ROWS 16
+
+typedef enum {
+    PLANAR_I444,
+    PLANAR_I422,
+    PLANAR_I420,
+    PLANAR_NV12
+} PlanarFormat;
+
+typedef enum {
+    CHROMA_BOX,
+    CHROMA_BILINEAR
+} ChromaFilter;
+
+// NV12 keeps interleaved CbCr in planes[1] and leaves planes[2] NULL.
+typedef struct {
+    PlanarFormat format;
+    int width;
+    int height;
+    int chromaWidth;
+    int chromaHeight;
+    uint8_t *planes[3];
+    size_t size;
+} PlanarImage;
+
+typedef void (*ChromaKernel)(const uint16_t *, uint8_t *, int, const int16_t *, int);
+
+typedef struct {
+    image source;
+    PlanarImage *planar;
+    ChromaFilter filter;
+    ChromaKernel kernel;
+} PlanarJob;
+
+static const char *planarFormatNames[4] = {"i444", "i422", "i420", "nv12"};
+
+boolean parsePlanarFormat(const char *name, PlanarFormat *format) {
+    for (int i = 0; i < 4; i++) {
+        if (SDL_strcasecmp(name, planarFormatNames[i]) == 0) {
+            *format = (PlanarFormat)i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Fills in the geometry and points the planes into data, which may be NULL
+// when only the size is wanted.
+void planarLayout(PlanarImage *planar, PlanarFormat format, int width, int height, uint8_t *data) {
+    size_t lumaBytes = (size_t)width * height;
+    planar->format = format;
+    planar->width = width;
+    planar->height = height;
+    planar->chromaWidth = (format == PLANAR_I444) ? width : (width + 1) / 2;
+    planar->chromaHeight = (format == PLANAR_I420 || format == PLANAR_NV12) ? (height + 1) / 2 : height;
+    size_t chromaBytes = (size_t)planar->chromaWidth * planar->chromaHeight;
+    planar->size = lumaBytes + chromaBytes * 2;
+    planar->planes[0] = data;
+    planar->planes[1] = data ? data + lumaBytes : NULL;
+    planar->planes[2] = (data && format != PLANAR_NV12) ? data + lumaBytes + chromaBytes : NULL;
+}
+
+static inline uint8_t lumaFromRGB(int32_t r, int32_t g, int32_t b) {
+    return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static inline uint16_t cbFromRGB(int32_t r, int32_t g, int32_t b) {
+    return (uint16_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline uint16_t crFromRGB(int32_t r, int32_t g, int32_t b) {
+    return (uint16_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+static inline uint32_t argbFromYCbCr(int32_t luma, int32_t cb, int32_t cr) {
+    int32_t c = 298 * (luma - 16);
+    int32_t d = cb - 128;
+    int32_t e = cr - 128;
+    return 0xFF000000 | (clampByte((c + 409 * e + 128) >> 8) << 16) |
+        (clampByte((c - 100 * d - 208 * e + 128) >> 8) << 8) | clampByte((c + 516 * d + 128) >> 8);
+}
+
+// padded[k + 1] holds the vertical chroma sum of column k, with the edge
+// columns repeated on both sides, so output x reads padded[2x .. 2x + 2].
+void downsampleChromaScalar(const uint16_t *padded, uint8_t *destination, int count, const int16_t *taps, int shift) {
+    for (int x = 0; x < count; x++) {
+        const uint16_t *p = padded + 2 * x;
+        destination[x] = (uint8_t)((taps[0] * p[0] + taps[1] * p[1] + taps[2] * p[2] + (1 << (shift - 1))) >> shift);
+    }
+}
+
+#ifdef X86_SIMD
+SSE2 void downsampleChromaSSE2(const uint16_t *padded, uint8_t *destination, int count, const int16_t *taps, int shift) {
+    const __m128i first = _mm_set1_epi32(PAIR(taps[0], taps[1])), second = _mm_set1_epi32(PAIR(taps[2], 0));
+    const __m128i bias = _mm_set1_epi32(1 << (shift - 1)), amount = _mm_cvtsi32_si128(shift);
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+        const uint16_t *p = padded + 2 * x;
+        __m128i low = _mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)p), first),
+                                    _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(p + 2)), second));
+        __m128i high = _mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)(p + 8)), first),
+                                     _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(p + 10)), second));
+        low = _mm_sra_epi32(_mm_add_epi32(low, bias), amount);
+        high = _mm_sra_epi32(_mm_add_epi32(high, bias), amount);
+        __m128i words = _mm_packs_epi32(low, high);
+        _mm_storel_epi64((__m128i *)(destination + x), _mm_packus_epi16(words, words));
+    }
+    downsampleChromaScalar(padded + 2 * x, destination + x, count - x, taps, shift);
+}
+
+AVX2 void downsampleChromaAVX2(const uint16_t *padded, uint8_t *destination, int count, const int16_t *taps, int shift) {
+    const __m256i first = _mm256_set1_epi32(PAIR(taps[0], taps[1])), second = _mm256_set1_epi32(PAIR(taps[2], 0));
+    const __m256i bias = _mm256_set1_epi32(1 << (shift - 1));
+    const __m128i amount = _mm_cvtsi32_si128(shift);
+    int x = 0;
+    for (; x + 16 <= count; x += 16) {
+        const uint16_t *p = padded + 2 * x;
+        __m256i low = _mm256_add_epi32(_mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)p), first),
+                                       _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(p + 2)), second));
+        __m256i high = _mm256_add_epi32(_mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(p + 16)), first),
+                                        _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(p + 18)), second));
+        low = _mm256_sra_epi32(_mm256_add_epi32(low, bias), amount);
+        high = _mm256_sra_epi32(_mm256_add_epi32(high, bias), amount);
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+        _mm_storeu_si128((__m128i *)(destination + x), _mm256_castsi256_si128(bytes));
+    }
+    downsampleChromaSSE2(padded + 2 * x, destination + x, count - x, taps, shift);
+}
+#endif
+
+ChromaKernel chromaKernel() {
+#ifdef X86_SIMD
+    if (SDL_HasAVX2())
+        return downsampleChromaAVX2;
+    if (SDL_HasSSE2())
+        return downsampleChromaSSE2;
+#endif
+    return downsampleChromaScalar;
+}
+
+void planarBand(void *context, int band) {
+    PlanarJob *job = (PlanarJob *)context;
+    PlanarImage *planar = job->planar;
+    int width = planar->width;
+    int rowsPerChroma = (planar->format == PLANAR_I420 || planar->format == PLANAR_NV12) ? 2 : 1;
+    int firstRow = band * PLANAR_BAND_ROWS;
+    int lastRow = (firstRow + PLANAR_BAND_ROWS < planar->chromaHeight) ? firstRow + PLANAR_BAND_ROWS : planar->chromaHeight;
+    uint16_t *sums = (uint16_t *)countedMalloc((size_t)(width + 3) * 2 * sizeof(uint16_t));
+    uint8_t *chroma = (uint8_t *)countedMalloc((size_t)planar->chromaWidth * 2);
+    if (sums == NULL || chroma == NULL) {
+        printf("Memory allocation failed for the chroma rows!\n");
+        free(sums);
+        free(chroma);
+        return;
+    }
+    uint16_t *cbSums = sums, *crSums = sums + width + 3;
+    int16_t taps[3] = {0, 1, 1};
+    int shift = rowsPerChroma;
+    if (job->filter == CHROMA_BILINEAR) {
+        taps[0] = 1;
+        taps[1] = 2;
+        shift++;
+    }
+    for (int chromaRow = firstRow; chromaRow < lastRow; chromaRow++) {
+        memset(sums, 0, (size_t)(width + 3) * 2 * sizeof(uint16_t));
+        for (int i = 0; i < rowsPerChroma; i++) {
+            int y = chromaRow * rowsPerChroma + i;
+            const uint32_t *source = job->source.pixelArray + (size_t)((y < planar->height) ? y : planar->height - 1) * width;
+            uint8_t *luma = planar->planes[0] + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                int32_t r = (source[x] >> 16) & 0xFF, g = (source[x] >> 8) & 0xFF, b = source[x] & 0xFF;
+                if (y < planar->height)
+                    luma[x] = lumaFromRGB(r, g, b);
+                cbSums[x + 1] += cbFromRGB(r, g, b);
+                crSums[x + 1] += crFromRGB(r, g, b);
+            }
+        }
+        size_t offset = (size_t)chromaRow * planar->chromaWidth;
+        if (planar->format == PLANAR_I444) {
+            for (int x = 0; x < width; x++) {
+                planar->planes[1][offset + x] = (uint8_t)cbSums[x + 1];
+                planar->planes[2][offset + x] = (uint8_t)crSums[x + 1];
+            }
+            continue;
+        }
+        cbSums[0] = cbSums[1];
+        crSums[0] = crSums[1];
+        cbSums[width + 1] = cbSums[width + 2] = cbSums[width];
+        crSums[width + 1] = crSums[width + 2] = crSums[width];
+        if (planar->format == PLANAR_NV12) {
+            job->kernel(cbSums, chroma, planar->chromaWidth, taps, shift);
+            job->kernel(crSums, chroma + planar->chromaWidth, planar->chromaWidth, taps, shift);
+            uint8_t *interleaved = planar->planes[1] + offset * 2;
+            for (int x = 0; x < planar->chromaWidth; x++) {
+                interleaved[2 * x] = chroma[x];
+                interleaved[2 * x + 1] = chroma[planar->chromaWidth + x];
+            }
+        } else {
+            job->kernel(cbSums, planar->planes[1] + offset, planar->chromaWidth, taps, shift);
+            job->kernel(crSums, planar->planes[2] + offset, planar->chromaWidth, taps, shift);
+        }
+    }
+    free(chroma);
+    free(sums);
+}
+
+PlanarImage planarFromImage(image source, PlanarFormat format, ChromaFilter filter) {
+    PlanarImage planar;
+    planarLayout(&planar, format, source.width, source.height, NULL);
+    uint8_t *data = (uint8_t *)countedMalloc(planar.size);
+    if (data == NULL) {
+        printf("Memory allocation failed for the planar image!\n");
+        return planar;
+    }
+    planarLayout(&planar, format, source.width, source.height, data);
+    PlanarJob job = {source, &planar, filter, chromaKernel()};
+    runParallel(planarBand, &job, (planar.chromaHeight + PLANAR_BAND_ROWS - 1) / PLANAR_BAND_ROWS);
+    return planar;
+}
+
+// Reconstructs ARGB with each chroma sample repeated over the pixels it
+// covers, which shows what the subsampling threw away.
+void planarToARGB(const PlanarImage *planar, uint32_t *destination) {
+    int horizontalShift = (planar->format == PLANAR_I444) ? 0 : 1;
+    int verticalShift = (planar->format == PLANAR_I420 || planar->format == PLANAR_NV12) ? 1 : 0;
+    for (int y = 0; y < planar->height; y++) {
+        const uint8_t *luma = planar->planes[0] + (size_t)y * planar->width;
+        size_t chromaRow = (size_t)(y >> verticalShift) * planar->chromaWidth;
+        uint32_t *row = destination + (size_t)y * planar->width;
+        for (int x = 0; x < planar->width; x++) {
+            size_t chroma = chromaRow + (x >> horizontalShift);
+            if (planar->format == PLANAR_NV12)
+                row[x] = argbFromYCbCr(luma[x], planar->planes[1][chroma * 2], planar->planes[1][chroma * 2 + 1]);
+            else
+                row[x] = argbFromYCbCr(luma[x], planar->planes[1][chroma], planar->planes[2][chroma]);
+        }
+    }
+}
+
+void printExportUsage() {
+    printf("Usage: main --export <format> <input.bmp> <output> [--chroma box|bilinear] [--preview preview.bmp]\n");
+    printf("Formats: i444 i422 i420 nv12\n");
+}
+
+int runExport(int argc, char *args[]) {
+    PlanarFormat format;
+    if (argc < 3 || !parsePlanarFormat(args[0], &format)) {
+        printExportUsage();
+        return 1;
+    }
+    ChromaFilter filter = CHROMA_BOX;
+    const char *previewPath = NULL;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(args[i], "--chroma") == 0 && i + 1 < argc) {
+            const char *name = args[++i];
+            if (strcmp(name, "box") == 0) {
+                filter = CHROMA_BOX;
+            } else if (strcmp(name, "bilinear") == 0) {
+                filter = CHROMA_BILINEAR;
+            } else {
+                printf("Unknown chroma filter: %s\n", name);
+                printExportUsage();
+                return 1;
+            }
+        } else if (strcmp(args[i], "--preview") == 0 && i + 1 < argc) {
+            previewPath = args[++i];
+        } else {
+            printf("Unknown option: %s\n", args[i]);
+            printExportUsage();
+            return 1;
+        }
+    }
+    image source = loadImage(args[1]);
+    if (source.pixelArray == NULL)
+        return 1;
+    initializeWorkerPool();
+    Uint64 start = SDL_GetPerformanceCounter();
+    PlanarImage planar = planarFromImage(source, format, filter);
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    boolean saved = FALSE;
+    if (planar.planes[0]) {
+        FILE *file = fopen(args[2], "wb");
+        saved = (file && fwrite(planar.planes[0], 1, planar.size, file) == planar.size) ? TRUE : FALSE;
+        if (file)
+            fclose(file);
+        if (saved)
+            printf("Wrote %dx%d %s (%zu bytes) to %s in %.3f ms\n",
+                planar.width, planar.height, planarFormatNames[format], planar.size, args[2], seconds * 1000.0);
+        else
+            printf("The planar image could not be written to %s\n", args[2]);
+    }
+    if (saved && previewPath) {
+        planarToARGB(&planar, source.pixelArray);
+        saved = saveImage(previewPath, source);
+    }
+    disposeWorkerPool();
+    free(planar.planes[0]);
+    free(source.pixelArray);
+    return saved ? 0 : 1;
+}
+
+// PLAYBACK: --play streams a numbered BMP sequence (a printf pattern such
+// as clip/frame%04d.bmp) or a raw RGB24 or planar YUV file (see PLANAR YUV)
+// through the display modes and the histogram. A prefetch thread decodes
+// frames into a small ring while the main loop shows each frame at its
+// presentation time, skipping the frames it is already late for and
+// counting the times it found the ring empty.
+#define PLAYBACK_RING_FRAMES 8
+
+typedef enum {
+    SOURCE_BMP_SEQUENCE,
+    SOURCE_RAW_RGB24,
+    SOURCE_RAW_PLANAR
+} PlaybackFormat;
+
+typedef struct {
+    image frame;
+    int index;
+} PlaybackSlot;
+
+typedef struct {
+    boolean active;
+    PlaybackFormat format;
+    int width;
+    int height;
+    int firstNumber;
+    int position;
+    FILE *file;
+    uint8_t *rawFrame;
+    size_t rawFrameBytes;
+    PlanarImage planar;
+    PlaybackSlot slots[PLAYBACK_RING_FRAMES];
+    int displayed;
+    int queued;
+    boolean hasFrame;
+    boolean finished;
+    boolean quit;
+    SDL_mutex *lock;
+    SDL_cond *slotFreed;
+    SDL_Thread *thread;
+    Uint64 start;
+    int shown;
+    int dropped;
+    int stalls;
+    int lastStall;
+} Playback;
+
+static Playback playback;
+
+// Ring slots and sequence frames reuse pixel pointers, so every cache keyed
+// on a pointer has to let go of a frame before its memory changes.
+void forgetImagePixels(const uint32_t *pixels) {
+    forgetMipmaps(pixels);
+    forgetTransforms(pixels);
+    if (ditherCache.source == pixels)
+        disposeDitherCache();
+    if (histogramCache.source == pixels)
+        histogramCache.valid = FALSE;
+    if (paletteCache.source == pixels)
+        paletteCache.valid = FALSE;
+}
+
+boolean sequenceFramePath(int number, char *path, size_t size) {
+    snprintf(path, size, playbackPath, number);
+    return (fileModifiedTime(path) != 0) ? TRUE : FALSE;
+}
+
+void convertRGB24Frame(const uint8_t *source, uint32_t *destination, int count) {
+    for (int i = 0; i < count; i++, source += 3)
+        destination[i] = 0xFF000000 | (source[0] << 16) | (source[1] << 8) | source[2];
+}
+
+// Runs on the prefetch thread. Sequence frames are decoded into fresh
+// images; raw frames are converted into the slot's own buffer.
+boolean decodePlaybackFrame(PlaybackSlot *slot) {
+    if (playback.format == SOURCE_BMP_SEQUENCE) {
+        char path[1024];
+        if (!sequenceFramePath(playback.firstNumber + playback.position, path, sizeof(path)))
+            return FALSE;
+        slot->frame = loadImage(path);
+        return (slot->frame.pixelArray != NULL) ? TRUE : FALSE;
+    }
+    if (fread(playback.rawFrame, 1, playback.rawFrameBytes, playback.file) != playback.rawFrameBytes)
+        return FALSE;
+    if (playback.format == SOURCE_RAW_RGB24)
+        convertRGB24Frame(playback.rawFrame, slot->frame.pixelArray, playback.width * playback.height);
+    else
+        planarToARGB(&playback.planar, slot->frame.pixelArray);
+    return TRUE;
+}
+
+void rewindPlayback() {
+    playback.position = 0;
+    if (playback.file)
+        seekFile(playback.file, 0);
+}
+
+int playbackThread(void *data) {
+    int index = 0;
+    SDL_LockMutex(playback.lock);
+    while (!playback.quit) {
+        if (playback.finished || playback.queued >= PLAYBACK_RING_FRAMES - 1) {
+            SDL_CondWait(playback.slotFreed, playback.lock);
+            continue;
         }
-    } else if (button.type == '-') {
-        for (int i = -4; i <= 4; i++) {
-            _API->pixels[centerY * SCREEN_WIDTH + (centerX + i)] = symbolColor;
+        PlaybackSlot *slot = &playback.slots[(playback.displayed + 1 + playback.queued) % PLAYBACK_RING_FRAMES];
+        SDL_UnlockMutex(playback.lock);
+        boolean decoded = decodePlaybackFrame(slot);
+        if (!decoded && playbackLoop && playback.position > 0) {
+            rewindPlayback();
+            decoded = decodePlaybackFrame(slot);
+        }
+        SDL_LockMutex(playback.lock);
+        if (decoded) {
+            slot->index = index++;
+            playback.position++;
+            playback.queued++;
+        } else {
+            playback.finished = TRUE;
         }
     }
+    SDL_UnlockMutex(playback.lock);
+    return 0;
 }
 
-void drawUI(API *_API, image alphabet) {
-    const int NUM_MODES = 7; 
-    const int NUM_COMPONENTS[NUM_MODES] = {4, 3, 3, 3, 0, 0, 0}; 
-    const int MARGIN = 8;  
-    const int BUTTON_SIZE = 16;
-    const int TEXT_OFFSET_Y = 5;
-    int startX = SCREEN_WIDTH / 2 + MARGIN;
-    int cursorY = MARGIN; 
-    for (int y = 0; y < SCREEN_HEIGHT; y++) {
-        for (int x = SCREEN_WIDTH / 2; x < SCREEN_WIDTH; x++) {
-            _API->pixels[y * SCREEN_WIDTH + x] = 0xFF505050;
-        }
-    }
-    Point titlePosition = {(uint16_t)(startX + 20), (uint16_t)(cursorY + TEXT_OFFSET_Y)};
-    drawText(_API, alphabet, titlePosition, "image display modes");
-    cursorY += 24;
-    const char *modeLabels[NUM_MODES] = {
-        "argb mode", "yuv mode", "yiq mode", "cmy mode", "monochrome mode", "dithered mode", "eight bit mode"};
-    const char *componentLabels[NUM_MODES][4] = {
-        {"alpha component", "red component", "green component", "blue component"},
-        {"y component", "u component", "v component"},
-        {"y component", "i component", "q component"},
-        {"c component", "m component", "y component"},
-        {""}, 
-        {""},  
-        {""}  
-    };
-    int buttonIndex = 0;
-    for (int i = 0; i < NUM_MODES; i++) {
-        cursorY += MARGIN;
-        if (cursorY + 20 >= SCREEN_HEIGHT) break;
-        uint32_t highlightColor = (checkboxes[i].checked) ? 0xFF77AAFF : 0xFF606060;
-        for (int y = cursorY; y < cursorY + 18; y++) {
-            for (int x = startX; x < SCREEN_WIDTH - MARGIN; x++) {
-                _API->pixels[y * SCREEN_WIDTH + x] = highlightColor;
+boolean parseFrameSize(const char *text, int *width, int *height) {
+    return (text && sscanf(text, "%dx%d", width, height) == 2 && *width > 0 && *height > 0) ? TRUE : FALSE;
+}
+
+boolean openPlayback() {
+    memset(&playback, 0, sizeof(playback));
+    PlanarFormat planarFormat = PLANAR_I420;
+    const char *format = playbackFormatName;
+    if (format == NULL) {
+        const char *extension = strrchr(playbackPath, '.');
+        if (strchr(playbackPath, '%'))
+            format = "bmp";
+        else if (extension && strcmp(extension, ".yuv") == 0)
+            format = "i420";
+        else
+            format = "rgb24";
+    }
+    if (strcmp(format, "bmp") == 0) {
+        char path[1024];
+        playback.format = SOURCE_BMP_SEQUENCE;
+        playback.firstNumber = sequenceFramePath(0, path, sizeof(path)) ? 0 : 1;
+        if (!sequenceFramePath(playback.firstNumber, path, sizeof(path))) {
+            printf("No frames match %s.\n", playbackPath);
+            return FALSE;
+        }
+    } else if (strcmp(format, "rgb24") == 0 || parsePlanarFormat(format, &planarFormat)) {
+        playback.format = (strcmp(format, "rgb24") == 0) ? SOURCE_RAW_RGB24 : SOURCE_RAW_PLANAR;
+        if (!parseFrameSize(playbackSize, &playback.width, &playback.height)) {
+            printf("Raw playback needs --size WIDTHxHEIGHT.\n");
+            return FALSE;
+        }
+        size_t pixels = (size_t)playback.width * playback.height;
+        planarLayout(&playback.planar, planarFormat, playback.width, playback.height, NULL);
+        playback.rawFrameBytes = (playback.format == SOURCE_RAW_PLANAR) ? playback.planar.size : pixels * 3;
+        playback.file = fopen(playbackPath, "rb");
+        playback.rawFrame = (uint8_t *)countedMalloc(playback.rawFrameBytes);
+        planarLayout(&playback.planar, planarFormat, playback.width, playback.height, playback.rawFrame);
+        if (playback.file == NULL || playback.rawFrame == NULL) {
+            printf("Playback failed to open %s\n", playbackPath);
+            closePlayback();
+            return FALSE;
+        }
+        for (int i = 0; i < PLAYBACK_RING_FRAMES; i++) {
+            uint32_t *pixelArray = (uint32_t *)countedMalloc(pixels * sizeof(uint32_t));
+            if (pixelArray == NULL) {
+                printf("Memory allocation failed for the playback ring!\n");
+                closePlayback();
+                return FALSE;
             }
+            playback.slots[i].frame = (image){playback.width, playback.height, pixelArray};
         }
-        checkboxes[i].position.x = startX + MARGIN;
-        checkboxes[i].position.y = cursorY + 3;
-        drawCheckbox(_API, checkboxes[i]);
-        Point textPosition = {(uint16_t)(checkboxes[i].position.x + 25), (uint16_t)(cursorY + TEXT_OFFSET_Y)};
-        drawText(_API, alphabet, textPosition, modeLabels[i]);
-        cursorY += 20;
-        if (cursorY >= SCREEN_HEIGHT) break;
-        for (int j = 0; j < NUM_COMPONENTS[i]; j++) {
-            if (cursorY + 18 >= SCREEN_HEIGHT) break;
-            int minusButtonX = startX + MARGIN;
-            int plusButtonX = minusButtonX + BUTTON_SIZE + MARGIN;
-            int textX = plusButtonX + BUTTON_SIZE + MARGIN;
-            buttons[buttonIndex].position.x = minusButtonX;
-            buttons[buttonIndex].position.y = cursorY + 3;
-            buttons[buttonIndex].type = '-';
-            drawButton(_API, buttons[buttonIndex]);
-            buttonIndex++;
-            buttons[buttonIndex].position.x = plusButtonX;
-            buttons[buttonIndex].position.y = cursorY + 3;
-            buttons[buttonIndex].type = '+';
-            drawButton(_API, buttons[buttonIndex]);
-            buttonIndex++;
-            Point compTextPos = {(uint16_t)textX, (uint16_t)(cursorY + TEXT_OFFSET_Y)};
-            drawText(_API, alphabet, compTextPos, componentLabels[i][j]);
-            cursorY += 18;
-            if (cursorY >= SCREEN_HEIGHT) break;
+    } else {
+        printf("Unknown playback format %s (use bmp, rgb24, i444, i422, i420 or nv12).\n", format);
+        return FALSE;
+    }
+    playback.displayed = PLAYBACK_RING_FRAMES - 1;
+    playback.lastStall = -1;
+    playback.lock = SDL_CreateMutex();
+    playback.slotFreed = SDL_CreateCond();
+    playback.active = TRUE;
+    playback.start = SDL_GetPerformanceCounter();
+    playback.thread = SDL_CreateThread(playbackThread, "playback", NULL);
+    if (playback.thread == NULL) {
+        printf("The playback thread failed to start, SDL Error: %s\n", SDL_GetError());
+        closePlayback();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void releasePlaybackSlot(PlaybackSlot *slot) {
+    forgetImagePixels(slot->frame.pixelArray);
+    if (playback.format == SOURCE_BMP_SEQUENCE) {
+        free(slot->frame.pixelArray);
+        slot->frame = (image){0, 0, NULL};
+    }
+}
+
+void closePlayback() {
+    if (playback.thread) {
+        SDL_LockMutex(playback.lock);
+        playback.quit = TRUE;
+        SDL_CondSignal(playback.slotFreed);
+        SDL_UnlockMutex(playback.lock);
+        SDL_WaitThread(playback.thread, NULL);
+        printf("Playback: %d frames shown, %d dropped, %d stalls waiting for the decoder.\n", playback.shown, playback.dropped, playback.stalls);
+    }
+    for (int i = 0; i < PLAYBACK_RING_FRAMES; i++) {
+        forgetImagePixels(playback.slots[i].frame.pixelArray);
+        free(playback.slots[i].frame.pixelArray);
+    }
+    if (playback.file)
+        fclose(playback.file);
+    free(playback.rawFrame);
+    if (playback.slotFreed)
+        SDL_DestroyCond(playback.slotFreed);
+    if (playback.lock)
+        SDL_DestroyMutex(playback.lock);
+    memset(&playback, 0, sizeof(playback));
+}
+
+int dueFrame() {
+    double elapsed = (double)(SDL_GetPerformanceCounter() - playback.start) / SDL_GetPerformanceFrequency();
+    return (int)(elapsed * playbackRate);
+}
+
+// Moves to the newest decoded frame that is due; the frames passed over
+// are dropped. Called from the main loop before deciding on a redraw.
+void advancePlayback() {
+    if (!playback.active)
+        return;
+    SDL_LockMutex(playback.lock);
+    int due = dueFrame();
+    int advanced = 0;
+    while (playback.queued > 0 && playback.slots[(playback.displayed + 1) % PLAYBACK_RING_FRAMES].index <= due) {
+        if (playback.hasFrame)
+            releasePlaybackSlot(&playback.slots[playback.displayed]);
+        playback.displayed = (playback.displayed + 1) % PLAYBACK_RING_FRAMES;
+        playback.queued--;
+        playback.hasFrame = TRUE;
+        advanced++;
+    }
+    if (advanced > 0) {
+        playback.shown++;
+        playback.dropped += advanced - 1;
+        SDL_CondSignal(playback.slotFreed);
+    } else if (playback.queued == 0 && !playback.finished && due > playback.lastStall &&
+               (!playback.hasFrame || playback.slots[playback.displayed].index < due)) {
+        playback.stalls++;
+        playback.lastStall = due;
+    }
+    SDL_UnlockMutex(playback.lock);
+}
+
+// Milliseconds until the next frame is due, or a short poll interval while
+// the decoder is behind.
+int playbackTimeout() {
+    if (!playback.active)
+        return IDLE_TIMEOUT_MS;
+    SDL_LockMutex(playback.lock);
+    int wait = IDLE_TIMEOUT_MS;
+    if (playback.queued > 0) {
+        int next = playback.slots[(playback.displayed + 1) % PLAYBACK_RING_FRAMES].index;
+        double elapsed = (double)(SDL_GetPerformanceCounter() - playback.start) / SDL_GetPerformanceFrequency();
+        wait = (int)ceil((next / playbackRate - elapsed) * 1000.0);
+    } else if (!playback.finished) {
+        wait = (int)(250.0 / playbackRate);
+    }
+    SDL_UnlockMutex(playback.lock);
+    return (wait > 0) ? wait : 0;
+}
+
+// Only the main thread moves the displayed slot, so the frame stays valid
+// for the rest of the frame without holding the lock.
+image playbackImage() {
+    if (!playback.active || !playback.hasFrame)
+        return (image){0, 0, NULL};
+    return playback.slots[playback.displayed].frame;
+}
+
+// RENDER SCHEDULER: a frame is produced only when one of its inputs has
+// changed since the last presented frame, and then only the affected
+// regions are repainted and uploaded.
+typedef enum {
+    REGION_IMAGE = 1,
+    REGION_PANEL = 2,
+    REGION_HISTOGRAM = 4,
+    REGION_CURSOR = 8,
+    REGION_PROFILER = 16,
+    REGION_ALL = 31
+} RenderRegion;
+
+typedef struct {
+    boolean valid;
+    DisplayMode display;
+    int offsetX;
+    int offsetY;
+    float zoom;
+    uint32_t parameters;
+    uint32_t assets;
+    boolean histogram;
+    boolean profiler;
+    int frame;
+    int loading;
+    Mouse mouse;
+} RenderState;
+
+static RenderState renderedState;
+static boolean redrawRequested = TRUE;
+
+RenderState currentRenderState(Mouse _Mouse) {
+    RenderState state;
+    state.valid = TRUE;
+    state.display = currentDisplay;
+    state.offsetX = imageOffsetX;
+    state.offsetY = imageOffsetY;
+    state.zoom = imageZoom;
+    state.parameters = parameterVersion;
+    state.assets = assetGeneration;
+    state.histogram = showHistogram;
+    state.profiler = showProfiler;
+    state.frame = playback.hasFrame ? playback.slots[playback.displayed].index : -1;
+    state.loading = loadingPercent();
+    state.mouse = _Mouse;
+    return state;
+}
+
+int dirtyRegions(RenderState state) {
+    if (!renderedState.valid || redrawRequested)
+        return REGION_ALL;
+    RenderState *last = &renderedState;
+    boolean contentChanged = (state.display != last->display || state.parameters != last->parameters || state.assets != last->assets || state.frame != last->frame) ? TRUE : FALSE;
+    int regions = 0;
+    if (contentChanged || state.offsetX != last->offsetX || state.offsetY != last->offsetY || state.zoom != last->zoom ||
+        state.loading != last->loading)
+        regions |= REGION_IMAGE;
+    if (state.display != last->display || state.assets != last->assets || panelDamaged())
+        regions |= REGION_PANEL;
+    if (state.histogram != last->histogram || (state.histogram && contentChanged))
+        regions |= REGION_HISTOGRAM;
+    if (state.profiler != last->profiler)
+        regions |= REGION_PROFILER;
+    if (state.mouse.mouseLocation.x != last->mouse.mouseLocation.x || state.mouse.mouseLocation.y != last->mouse.mouseLocation.y ||
+        state.mouse._MouseButtonLeft != last->mouse._MouseButtonLeft)
+        regions |= REGION_CURSOR;
+    return regions;
+}
+
+boolean frameNeeded(Mouse _Mouse) {
+    return dirtyRegions(currentRenderState(_Mouse)) != 0 ? TRUE : FALSE;
+}
+
+void requestRedraw() {
+    redrawRequested = TRUE;
+}
+
+SDL_Rect regionRect(int region) {
+    switch (region) {
+    case REGION_IMAGE: return (SDL_Rect){0, 0, SCREEN_WIDTH / 2, SCREEN_HEIGHT};
+    case REGION_PANEL: return (SDL_Rect){SCREEN_WIDTH / 2, 0, SCREEN_WIDTH - SCREEN_WIDTH / 2, SCREEN_HEIGHT};
+    case REGION_HISTOGRAM: return (SDL_Rect){0, 50, SCREEN_WIDTH, 230};
+    case REGION_PROFILER: return profilerOverlayRect();
+    default: return (SDL_Rect){0, 0, 0, 0};
+    }
+}
+
+// LAYERS: the image pane, the control panel, the histogram and the profiler
+// overlay each own a screen-sized streaming texture that is drawn in screen
+// coordinates, repainted only when its inputs change and composited by
+// copying its area with SDL_RenderCopy. The changed parts of a layer are
+// kept as a short list of rectangles; rectangles that overlap or abut are
+// merged while the union covers no extra area.
+#define MAX_DIRTY_RECTS 8
+
+typedef struct {
+    SDL_Rect rects[MAX_DIRTY_RECTS];
+    int count;
+} DirtyRects;
+
+int rectArea(SDL_Rect rect) {
+    return rect.w * rect.h;
+}
+
+void addDirtyRect(DirtyRects *dirty, SDL_Rect rect) {
+    if (SDL_RectEmpty(&rect))
+        return;
+    int cheapest = -1;
+    int cheapestGrowth = 0;
+    for (int i = 0; i < dirty->count; i++) {
+        SDL_Rect merged;
+        SDL_UnionRect(&dirty->rects[i], &rect, &merged);
+        int growth = rectArea(merged) - rectArea(dirty->rects[i]) - rectArea(rect);
+        if (growth <= 0) {
+            dirty->rects[i] = dirty->rects[--dirty->count];
+            addDirtyRect(dirty, merged);
+            return;
+        }
+        if (cheapest < 0 || growth < cheapestGrowth) {
+            cheapest = i;
+            cheapestGrowth = growth;
         }
-        cursorY += MARGIN;
     }
+    if (dirty->count == MAX_DIRTY_RECTS) {
+        SDL_Rect merged;
+        SDL_UnionRect(&dirty->rects[cheapest], &rect, &merged);
+        dirty->rects[cheapest] = dirty->rects[--dirty->count];
+        addDirtyRect(dirty, merged);
+        return;
+    }
+    dirty->rects[dirty->count++] = rect;
 }
 
-void handleAPI(API *_API, Mouse _Mouse) {
-    memset(_API->pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
-    image image1 = loadImage("images\\FELV-cat.bmp");
-    image alphabet = loadImage("images\\alphabet_revised.bmp");
-    image numbers = loadImage("images\\numbers.bmp");
-    if (image1.pixelArray) {
-        Point point = {10, 10};
-        switch (currentDisplay) {
-        case DISPLAY_ARGB:
-            displayImageInARGB(_API, image1, point);
-            break;
-        case DISPLAY_YUV:
-            displayImageInYUV(_API, image1, point);
-            break;
-        case DISPLAY_YIQ:
-            displayImageInYIQ(_API, image1, point);
-            break;
-        case DISPLAY_CMY:
-            displayImageInCMY(_API, image1, point);
-            break;
-        case DISPLAY_MONOCHROME:
-            displayImageInMonochrome(_API, image1, point);
-            break;
-        case DISPLAY_DITHERED:
-            displayImageInDithered1Bit(_API, image1, point);
-            break;
-        case DISPLAY_8BIT:
-            displayImageIn8Bit(_API, image1, point);
-            break;
+// Streaming texture memory is write-only in general, but the software and
+// OpenGL renderers hand out the same persistent copy on every lock. When a
+// probe shows that the memory, its layout and its contents survive between
+// locks, frames are drawn straight into it and locking a dirty rectangle
+// only uploads it. Other renderers draw into a separate frame buffer that
+// is copied into the locked rectangles.
+Uint32 *persistentTexturePixels(SDL_Texture *texture) {
+    const Uint32 marker = 0x5A17C0DE;
+    size_t count = (size_t)SCREEN_WIDTH * SCREEN_HEIGHT;
+    void *first;
+    void *second;
+    void *inner;
+    int pitch;
+    if (SDL_LockTexture(texture, NULL, &first, &pitch) != 0)
+        return NULL;
+    boolean usable = (pitch == SCREEN_WIDTH * (int)sizeof(Uint32)) ? TRUE : FALSE;
+    if (usable) {
+        memset(first, 0, count * sizeof(Uint32));
+        ((Uint32 *)first)[count - 1] = marker;
+    }
+    SDL_UnlockTexture(texture);
+    if (!usable || SDL_LockTexture(texture, NULL, &second, &pitch) != 0)
+        return NULL;
+    usable = (second == first && pitch == SCREEN_WIDTH * (int)sizeof(Uint32) && ((Uint32 *)second)[count - 1] == marker) ? TRUE : FALSE;
+    ((Uint32 *)second)[count - 1] = 0;
+    SDL_UnlockTexture(texture);
+    SDL_Rect corner = {SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1, 1, 1};
+    if (!usable || SDL_LockTexture(texture, &corner, &inner, &pitch) != 0)
+        return NULL;
+    usable = (inner == (void *)((Uint32 *)first + count - 1) && pitch == SCREEN_WIDTH * (int)sizeof(Uint32)) ? TRUE : FALSE;
+    SDL_UnlockTexture(texture);
+    return usable ? (Uint32 *)first : NULL;
+}
+
+typedef enum {
+    LAYER_IMAGE,
+    LAYER_PANEL,
+    LAYER_HISTOGRAM,
+    LAYER_PROFILER,
+    LAYER_COUNT
+} LayerId;
+
+typedef struct {
+    SDL_Texture *texture;
+    Uint32 *pixels;
+    boolean direct;
+    SDL_Rect area;
+    DirtyRects dirty;
+} Layer;
+
+static Layer layers[LAYER_COUNT];
+
+boolean initializeLayers(SDL_Renderer *renderer) {
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        Layer *layer = &layers[i];
+        layer->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+        if (layer->texture == NULL)
+            return FALSE;
+        layer->pixels = persistentTexturePixels(layer->texture);
+        layer->direct = (layer->pixels != NULL) ? TRUE : FALSE;
+        if (!layer->direct)
+            layer->pixels = (Uint32 *)allocateAligned(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32), CACHE_LINE_SIZE);
+        if (layer->pixels == NULL) {
+            printf("Memory allocation for pixels failed.\n");
+            return FALSE;
         }
+        memset(layer->pixels, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+    }
+    return TRUE;
+}
+
+void disposeLayers() {
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        if (layers[i].pixels && !layers[i].direct)
+            freeAligned(layers[i].pixels);
+        if (layers[i].texture)
+            SDL_DestroyTexture(layers[i].texture);
+    }
+    memset(layers, 0, sizeof(layers));
+}
+
+// Points the drawing functions at a layer whose area is about to be
+// repainted.
+void beginLayer(API *_API, LayerId id, SDL_Rect area) {
+    layers[id].area = area;
+    addDirtyRect(&layers[id].dirty, area);
+    _API->pixels = layers[id].pixels;
+}
+
+// Uploads only the bounds of the damaged widgets unless the whole panel is
+// being repainted.
+void repaintPanel(API *_API, image alphabet) {
+    const UILayout *layout = uiLayout();
+    damageChangedWidgets();
+    Layer *panel = &layers[LAYER_PANEL];
+    panel->area = layout->widgets[0].bounds;
+    for (int i = 0; i < layout->widgetCount; i++) {
+        if (!layout->widgets[i].damaged)
+            continue;
+        addDirtyRect(&panel->dirty, layout->widgets[i].bounds);
+        if (i == 0)
+            break;
     }
+    _API->pixels = panel->pixels;
     drawUI(_API, alphabet);
-    if (showHistogram) {
-        int histogram[256] = {0};
-        computeHistogram(image1, histogram);
-        drawHistogram(_API, histogram, numbers);
+}
+
+// Panning only moves the image, so the pixels already in the image layer
+// are scrolled in place and the strips that came into view are returned
+// for repainting. Any other change, an overlaid load progress bar or a
+// tiled image dithered on screen repaints the whole pane.
+int scrollImageLayer(RenderState state, image _image, SDL_Rect exposed[2]) {
+    SDL_Rect pane = regionRect(REGION_IMAGE);
+    RenderState *last = &renderedState;
+    int dx = state.offsetX - last->offsetX;
+    int dy = state.offsetY - last->offsetY;
+    exposed[0] = pane;
+    if (!last->valid || redrawRequested || state.display != last->display || state.parameters != last->parameters ||
+        state.assets != last->assets || state.frame != last->frame || state.zoom != last->zoom ||
+        state.loading != last->loading || state.loading >= 0 || (dx == 0 && dy == 0) ||
+        abs(dx) >= pane.w || abs(dy) >= pane.h || (_image.tiles && state.display == DISPLAY_DITHERED))
+        return 1;
+    uint32_t *pixels = layers[LAYER_IMAGE].pixels;
+    int width = pane.w - abs(dx);
+    int fromX = (dx < 0) ? -dx : 0;
+    int toX = (dx > 0) ? dx : 0;
+    if (dy > 0) {
+        for (int y = pane.h - 1; y >= dy; y--)
+            memmove(pixels + y * SCREEN_WIDTH + toX, pixels + (y - dy) * SCREEN_WIDTH + fromX, width * sizeof(uint32_t));
+    } else {
+        for (int y = 0; y < pane.h + dy; y++)
+            memmove(pixels + y * SCREEN_WIDTH + toX, pixels + (y - dy) * SCREEN_WIDTH + fromX, width * sizeof(uint32_t));
     }
-    drawMouse(_API, _Mouse);
-    SDL_UpdateTexture(_API->texture, NULL, _API->pixels, SCREEN_WIDTH * sizeof(Uint32));
+    int count = 0;
+    int rowsY = 0;
+    int rowsH = pane.h;
+    if (dy != 0) {
+        exposed[count++] = (dy > 0) ? (SDL_Rect){0, 0, pane.w, dy} : (SDL_Rect){0, pane.h + dy, pane.w, -dy};
+        rowsY = (dy > 0) ? dy : 0;
+        rowsH = pane.h - abs(dy);
+    }
+    if (dx != 0)
+        exposed[count++] = (dx > 0) ? (SDL_Rect){0, rowsY, dx, rowsH} : (SDL_Rect){pane.w + dx, rowsY, -dx, rowsH};
+    return count;
+}
+
+void submitLayers() {
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        Layer *layer = &layers[i];
+        for (int r = 0; r < layer->dirty.count; r++) {
+            const SDL_Rect *rect = &layer->dirty.rects[r];
+            void *locked;
+            int pitch;
+            if (SDL_LockTexture(layer->texture, rect, &locked, &pitch) != 0)
+                continue;
+            if (!layer->direct) {
+                for (int y = 0; y < rect->h; y++)
+                    memcpy((uint8_t *)locked + (size_t)y * pitch, &layer->pixels[(rect->y + y) * SCREEN_WIDTH + rect->x], rect->w * sizeof(Uint32));
+            }
+            SDL_UnlockTexture(layer->texture);
+        }
+        layer->dirty.count = 0;
+    }
+}
+
+void compositeLayers(API *_API, Mouse _Mouse) {
+    boolean visible[LAYER_COUNT] = {TRUE, TRUE, showHistogram, showProfiler};
     SDL_RenderClear(_API->renderer);
-    SDL_RenderCopy(_API->renderer, _API->texture, NULL, NULL);
+    for (int i = 0; i < LAYER_COUNT; i++) {
+        if (visible[i] && !SDL_RectEmpty(&layers[i].area))
+            SDL_RenderCopy(_API->renderer, layers[i].texture, &layers[i].area, &layers[i].area);
+    }
+    drawMouse(_API, _Mouse);
     SDL_RenderPresent(_API->renderer);
-    if (image1.pixelArray)
-        free(image1.pixelArray);
+}
+
+void handleAPI(API *_API, Mouse _Mouse) {
+    beginStage(STAGE_FRAME);
+    openFrameArena();
+    beginStage(STAGE_ASSETS);
+    Asset *imageAsset = acquireAsset("images/FELV-cat.bmp", TRUE);
+    Asset *alphabetAsset = acquireAsset("images/alphabet_revised.bmp", FALSE);
+    Asset *numbersAsset = acquireAsset("images/numbers.bmp", FALSE);
+    image image1 = assetImage(imageAsset);
+    image alphabet = assetImage(alphabetAsset);
+    image numbers = assetImage(numbersAsset);
+    if (playback.active)
+        image1 = playbackImage();
+    endStage(STAGE_ASSETS);
+    RenderState state = currentRenderState(_Mouse);
+    int regions = dirtyRegions(state);
+    beginStage(STAGE_IMAGE);
+    SDL_Rect exposed[2];
+    int exposedCount = 0;
+    if (regions & REGION_IMAGE) {
+        beginLayer(_API, LAYER_IMAGE, regionRect(REGION_IMAGE));
+        exposedCount = scrollImageLayer(state, image1, exposed);
+    }
+    Point point = {10, 10};
+    for (int i = 0; i < exposedCount; i++) {
+        paneClip = exposed[i];
+        fillRect(_API->pixels, exposed[i], 0);
+        if (image1.pixelArray || image1.tiles)
+            displayImage(_API, image1, point);
+    }
+    paneClip = (SDL_Rect){0, 0, 0, 0};
+    if ((regions & REGION_IMAGE) && state.loading >= 0)
+        drawLoadProgress(_API, state.loading, alphabet, numbers);
+    endStage(STAGE_IMAGE);
+    beginStage(STAGE_PANEL);
+    if (regions & REGION_PANEL) {
+        if (regions == REGION_ALL || state.assets != renderedState.assets)
+            damagePanel();
+        repaintPanel(_API, alphabet);
+    }
+    endStage(STAGE_PANEL);
+    beginStage(STAGE_HISTOGRAM);
+    if (showHistogram && (regions & REGION_HISTOGRAM)) {
+        beginLayer(_API, LAYER_HISTOGRAM, regionRect(REGION_HISTOGRAM));
+        const Histograms *histograms = displayHistograms(image1, currentDisplay);
+        drawHistogram(_API, histogramForMode(histograms, currentDisplay), numbers);
+    }
+    endStage(STAGE_HISTOGRAM);
+    if (showProfiler) {
+        beginLayer(_API, LAYER_PROFILER, regionRect(REGION_PROFILER));
+        drawProfilerOverlay(_API, alphabet, numbers);
+    }
+    beginStage(STAGE_UPLOAD);
+    submitLayers();
+    endStage(STAGE_UPLOAD);
+    beginStage(STAGE_PRESENT);
+    compositeLayers(_API, _Mouse);
+    endStage(STAGE_PRESENT);
+    closeFrameArena();
+    renderedState = state;
+    redrawRequested = FALSE;
+    releaseAsset(numbersAsset);
+    releaseAsset(alphabetAsset);
+    releaseAsset(imageAsset);
+    endStage(STAGE_FRAME);
+}
+
+// BATCH MODE: applies one display mode, or a comma-separated chain of them
+// run as a filter graph, to every BMP in a directory without opening a
+// window, spreading the images over the worker pool.
+typedef struct {
+    const char *name;
+    float *value;
+} ScaleParameter;
+
+static ScaleParameter scaleParameters[] = {
+    {"alpha", &alphaScale}, {"red", &redScale}, {"green", &greenScale}, {"blue", &blueScale},
+    {"yuv-y", &yScale}, {"u", &uScale}, {"v", &vScale},
+    {"yiq-y", &yiqYScale}, {"i", &iScale}, {"q", &qScale},
+    {"c", &cScale}, {"m", &mScale}, {"cmy-y", &yCmyScale}
+};
+
+static const char *displayModeNames[7] = {"argb", "yuv", "yiq", "cmy", "monochrome", "dithered", "8bit"};
+
+typedef struct {
+    char **files;
+    int fileCount;
+    const char *inputDirectory;
+    const char *outputDirectory;
+    DisplayMode modes[FILTER_MAX_NODES];
+    int modeCount;
+    char chain[128];
+    int64_t *pixelCounts;
+    SDL_atomic_t failures;
+} BatchJob;
+
+boolean saveImage(const char *filePath, image _image) {
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(
+        _image.pixelArray, _image.width, _image.height, 32, _image.width * sizeof(uint32_t), SDL_PIXELFORMAT_ARGB8888);
+    if (surface == NULL) {
+        printf("Surface creation failed for %s, SDL Error: %s\n", filePath, SDL_GetError());
+        return FALSE;
+    }
+    boolean saved = (SDL_SaveBMP(surface, filePath) == 0) ? TRUE : FALSE;
+    if (!saved)
+        printf("The image failed to save to %s, SDL Error: %s\n", filePath, SDL_GetError());
+    SDL_FreeSurface(surface);
+    return saved;
+}
+
+void convertBatchImage(void *context, int index) {
+    BatchJob *job = (BatchJob *)context;
+    char inputPath[1024];
+    char outputPath[1024];
+    snprintf(inputPath, sizeof(inputPath), "%s/%s", job->inputDirectory, job->files[index]);
+    snprintf(outputPath, sizeof(outputPath), "%s/%s", job->outputDirectory, job->files[index]);
+    image source = loadImage(inputPath);
+    if (source.pixelArray == NULL) {
+        SDL_AtomicAdd(&job->failures, 1);
+        return;
+    }
+    image converted = filterImage(source, job->modes, job->modeCount);
+    if (converted.pixelArray == NULL || !saveImage(outputPath, converted))
+        SDL_AtomicAdd(&job->failures, 1);
+    else
+        job->pixelCounts[index] = (int64_t)source.width * source.height;
+    free(converted.pixelArray);
+    free(source.pixelArray);
+}
+
+void printBatchUsage() {
+    printf("Usage: main --batch <mode>[,<mode>...] <input directory> <output directory> [--threads N] [--scale name=value]...\n");
+    printf("Modes: argb yuv yiq cmy monochrome dithered 8bit (dithered can only come last)\n");
+    printf("Scales: alpha red green blue yuv-y u v yiq-y i q c m cmy-y\n");
+}
+
+int runBatch(int argc, char *args[]) {
+    if (argc < 3) {
+        printBatchUsage();
+        return 1;
+    }
+    BatchJob job;
+    memset(&job, 0, sizeof(job));
+    for (char *token = strtok(args[0], ","); token; token = strtok(NULL, ",")) {
+        int mode = -1;
+        for (int i = 0; i < 7; i++) {
+            if (SDL_strcasecmp(token, displayModeNames[i]) == 0)
+                mode = i;
+        }
+        if (mode < 0 || job.modeCount == FILTER_MAX_NODES) {
+            printf(mode < 0 ? "Unknown display mode: %s\n" : "Too many display modes at %s\n", token);
+            printBatchUsage();
+            return 1;
+        }
+        job.modes[job.modeCount++] = (DisplayMode)mode;
+        snprintf(job.chain + strlen(job.chain), sizeof(job.chain) - strlen(job.chain), "%s%s", job.modeCount > 1 ? "," : "", displayModeNames[mode]);
+    }
+    if (job.modeCount == 0) {
+        printBatchUsage();
+        return 1;
+    }
+    job.inputDirectory = args[1];
+    job.outputDirectory = args[2];
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(args[i], "--threads") == 0 && i + 1 < argc) {
+            workerThreadLimit = atoi(args[++i]);
+        } else if (strcmp(args[i], "--scale") == 0 && i + 1 < argc) {
+            const char *assignment = args[++i];
+            const char *separator = strchr(assignment, '=');
+            boolean known = FALSE;
+            for (size_t j = 0; separator && j < sizeof(scaleParameters) / sizeof(scaleParameters[0]); j++) {
+                size_t nameLength = strlen(scaleParameters[j].name);
+                if ((size_t)(separator - assignment) == nameLength && strncmp(assignment, scaleParameters[j].name, nameLength) == 0) {
+                    *scaleParameters[j].value = (float)atof(separator + 1);
+                    parameterVersion++;
+                    known = TRUE;
+                }
+            }
+            if (!known) {
+                printf("Unknown scale parameter: %s\n", assignment);
+                printBatchUsage();
+                return 1;
+            }
+        } else {
+            printf("Unknown option: %s\n", args[i]);
+            printBatchUsage();
+            return 1;
+        }
+    }
+
+    FilterGraph *graph = createFilterGraph(job.modes, job.modeCount);
+    if (graph == NULL) {
+        printBatchUsage();
+        return 1;
+    }
+    disposeFilterGraph(graph);
+    DIR *directory = opendir(job.inputDirectory);
+    if (directory == NULL) {
+        printf("Cannot open input directory %s\n", job.inputDirectory);
+        return 1;
+    }
+    int capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || SDL_strcasecmp(entry->d_name + length - 4, ".bmp") != 0)
+            continue;
+        if (job.fileCount == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            job.files = (char **)countedRealloc(job.files, capacity * sizeof(char *));
+        }
+        job.files[job.fileCount++] = strdup(entry->d_name);
+    }
+    closedir(directory);
+    if (job.fileCount == 0) {
+        printf("No BMP files found in %s\n", job.inputDirectory);
+        return 1;
+    }
+    job.pixelCounts = (int64_t *)countedCalloc(job.fileCount, sizeof(int64_t));
+    SDL_AtomicSet(&job.failures, 0);
+
+    initializeWorkerPool();
+    prepareColorTables();
+    Uint64 start = SDL_GetPerformanceCounter();
+    runParallel(convertBatchImage, &job, job.fileCount);
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    int64_t totalPixels = 0;
+    for (int i = 0; i < job.fileCount; i++)
+        totalPixels += job.pixelCounts[i];
+    int failures = SDL_AtomicGet(&job.failures);
+    int converted = job.fileCount - failures;
+    printf("Converted %d of %d images to %s mode with %d threads in %.3f s\n",
+        converted, job.fileCount, job.chain, workerCount(), seconds);
+    if (seconds > 0)
+        printf("%.2f images/s, %.2f MPix/s\n", converted / seconds, totalPixels / seconds / 1e6);
+
+    disposeWorkerPool();
+    for (int i = 0; i < job.fileCount; i++)
+        free(job.files[i]);
+    free(job.files);
+    free(job.pixelCounts);
+    return failures ? 1 : 0;
+}
+
+// BENCHMARKS: times the pixel kernels headlessly on synthetic images and
+// reports throughput and per-pixel cost with the spread over repetitions.
+#define BENCH_MAX_SIZES 8
+#define BENCH_MAX_REPEATS 100
+
+typedef void (*BenchFunction)(void *);
+
+typedef struct {
+    image source;
+    image scratch;
+    RowFunction rowFunction;
+    float zoom;
+    API *api;
+    image alphabet;
+    const char *path;
+    FilterGraph *graph;
+} BenchContext;
+
+image syntheticImage(double megapixels) {
+    int width = (int)sqrt(megapixels * 1e6 * 4 / 3);
+    int height = (int)(megapixels * 1e6 / width);
+    uint32_t *pixelArray = (uint32_t *)countedMalloc((size_t)width * height * sizeof(uint32_t));
+    if (pixelArray == NULL) {
+        printf("Memory allocation failed for the %.1f MPix benchmark image!\n", megapixels);
+        return (image){0, 0, NULL};
+    }
+    uint32_t seed = 12345;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            seed = seed * 1103515245u + 12345u;
+            uint8_t noise = (seed >> 16) & 0x1F;
+            uint8_t r = (uint8_t)(x * 255 / width) ^ noise;
+            uint8_t g = (uint8_t)(y * 255 / height) ^ noise;
+            uint8_t b = (uint8_t)((x + y) * 255 / (width + height));
+            pixelArray[(size_t)y * width + x] = 0xFF000000 | (r << 16) | (g << 8) | b;
+        }
+    }
+    return (image){width, height, pixelArray};
+}
+
+void runBenchmark(const char *name, BenchFunction function, void *context, double pixels, int repeats) {
+    double nanoseconds[BENCH_MAX_REPEATS];
+    function(context);
+    for (int i = 0; i < repeats; i++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        function(context);
+        Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+        nanoseconds[i] = (double)elapsed * 1e9 / SDL_GetPerformanceFrequency() / pixels;
+    }
+    double mean = 0, variance = 0;
+    for (int i = 0; i < repeats; i++)
+        mean += nanoseconds[i];
+    mean /= repeats;
+    for (int i = 0; i < repeats; i++)
+        variance += (nanoseconds[i] - mean) * (nanoseconds[i] - mean);
+    variance = (repeats > 1) ? variance / (repeats - 1) : 0;
+    printf("  %-26s %10.2f MPix/s %9.3f ns/pixel +- %.3f\n", name, (mean > 0) ? 1e3 / mean : 0, mean, sqrt(variance));
+}
+
+void benchLoad(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    image loaded = loadImage(bench->path);
+    free(loaded.pixelArray);
+}
+
+void benchRows(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    for (int y = 0; y < bench->source.height; y++) {
+        size_t offset = (size_t)y * bench->source.width;
+        bench->rowFunction(bench->source.pixelArray + offset, bench->scratch.pixelArray + offset, bench->source.width);
+    }
+}
+
+void benchDither(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    free(Dithered1BitColor(bench->source.pixelArray, bench->source.width, bench->source.height, NULL));
+}
+
+void benchHistogram(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    histogramCache.valid = FALSE;
+    displayHistograms(bench->source, DISPLAY_ARGB);
+}
+
+void benchPalette(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    paletteCache.valid = FALSE;
+    imagePalette(bench->source);
+}
+
+void benchMovement(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    imageZoom = bench->zoom;
+    applyImageMovement(bench->api->pixels, bench->source, (Point){0, 0}, ARGBRow);
+}
+
+void benchFilterGraph(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    applyFilterStages(bench->graph, bench->source, bench->scratch.pixelArray);
+}
+
+void benchUI(void *context) {
+    BenchContext *bench = (BenchContext *)context;
+    damagePanel();
+    drawUI(bench->api, bench->alphabet);
+}
+
+void printBenchUsage() {
+    printf("Usage: main --bench [--sizes 0.1,1,10,50] [--repeat N] [--threads N]\n");
+}
+
+int runBench(int argc, char *args[]) {
+    double sizes[BENCH_MAX_SIZES] = {0.1, 1, 10, 50};
+    int sizeCount = 4;
+    int repeats = 5;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(args[i], "--sizes") == 0 && i + 1 < argc) {
+            sizeCount = 0;
+            for (char *token = strtok(args[++i], ","); token && sizeCount < BENCH_MAX_SIZES; token = strtok(NULL, ","))
+                sizes[sizeCount++] = atof(token);
+        } else if (strcmp(args[i], "--repeat") == 0 && i + 1 < argc) {
+            repeats = atoi(args[++i]);
+            repeats = (repeats < 1) ? 1 : (repeats > BENCH_MAX_REPEATS) ? BENCH_MAX_REPEATS : repeats;
+        } else if (strcmp(args[i], "--threads") == 0 && i + 1 < argc) {
+            workerThreadLimit = atoi(args[++i]);
+        } else {
+            printf("Unknown option: %s\n", args[i]);
+            printBenchUsage();
+            return 1;
+        }
+    }
+    InitializeEightBitPalette();
+    initializeWorkerPool();
+    prepareColorTables();
+    API api;
+    memset(&api, 0, sizeof(api));
+    api.pixels = (Uint32 *)allocateAligned(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32), CACHE_LINE_SIZE);
+    BenchContext bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.api = &api;
+    bench.path = "bench_input.bmp";
+    const DisplayMode chain[3] = {DISPLAY_ARGB, DISPLAY_CMY, DISPLAY_YUV};
+    bench.graph = createFilterGraph(chain, 3);
+    printf("Benchmarks with %d threads, %d repetitions, %s colour kernels\n",
+        workerCount(), repeats, colorKernels()->vectorized ? "SIMD" : "scalar");
+
+    bench.alphabet = loadImage("images/alphabet_revised.bmp");
+    if (bench.alphabet.pixelArray) {
+        printf("User interface\n");
+        runBenchmark("drawUI", benchUI, &bench, (double)(SCREEN_WIDTH - SCREEN_WIDTH / 2) * SCREEN_HEIGHT, repeats);
+    }
+
+    const char *modeNames[7] = {"ARGBRow", "YUVRow", "YIQRow", "CMYRow", "MonochromeRow", "", "EightBitRow"};
+    const float zooms[5] = {0.25f, 0.5f, 1.0f, 2.0f, 5.0f};
+    for (int s = 0; s < sizeCount; s++) {
+        bench.source = syntheticImage(sizes[s]);
+        bench.scratch = syntheticImage(sizes[s]);
+        if (bench.source.pixelArray == NULL || bench.scratch.pixelArray == NULL) {
+            free(bench.source.pixelArray);
+            free(bench.scratch.pixelArray);
+            continue;
+        }
+        double pixels = (double)bench.source.width * bench.source.height;
+        printf("%dx%d (%.1f MPix)\n", bench.source.width, bench.source.height, pixels / 1e6);
+        if (saveImage(bench.path, bench.source)) {
+            runBenchmark("loadImage", benchLoad, &bench, pixels, repeats);
+            remove(bench.path);
+        }
+        for (int mode = 0; mode < 7; mode++) {
+            if (mode == DISPLAY_DITHERED)
+                continue;
+            bench.rowFunction = rowFunctionForMode((DisplayMode)mode);
+            if (mode == DISPLAY_8BIT)
+                selectEightBitPalette(bench.source);
+            runBenchmark(modeNames[mode], benchRows, &bench, pixels, repeats);
+        }
+        if (bench.graph)
+            runBenchmark("filterGraph argb,cmy,yuv", benchFilterGraph, &bench, pixels, repeats);
+        runBenchmark("buildPalette", benchPalette, &bench, pixels, repeats);
+        runBenchmark("Dithered1BitColor", benchDither, &bench, pixels, repeats);
+        runBenchmark("displayHistograms", benchHistogram, &bench, pixels, repeats);
+        for (int z = 0; z < 5; z++) {
+            char name[32];
+            int visibleWidth = (int)(bench.source.width * zooms[z]);
+            int visibleHeight = (int)(bench.source.height * zooms[z]);
+            visibleWidth = (visibleWidth < SCREEN_WIDTH / 2) ? visibleWidth : SCREEN_WIDTH / 2;
+            visibleHeight = (visibleHeight < SCREEN_HEIGHT) ? visibleHeight : SCREEN_HEIGHT;
+            if (visibleWidth <= 0 || visibleHeight <= 0)
+                continue;
+            bench.zoom = zooms[z];
+            snprintf(name, sizeof(name), "applyImageMovement %.2fx", zooms[z]);
+            runBenchmark(name, benchMovement, &bench, (double)visibleWidth * visibleHeight, repeats);
+        }
+        forgetMipmaps(bench.source.pixelArray);
+        free(bench.source.pixelArray);
+        free(bench.scratch.pixelArray);
+    }
+    imageZoom = 1.0f;
+    free(bench.alphabet.pixelArray);
+    disposeFilterGraph(bench.graph);
+    freeAligned(api.pixels);
+    disposeBlitter();
+    disposeGlyphAtlases();
+    disposeWorkerPool();
+    return 0;
 }